@@ -0,0 +1,56 @@
+#include "alloc_counter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+#ifdef TRANSPORT_CATALOGUE_STATS
+
+namespace {
+std::atomic<size_t> allocation_count{0};
+}
+
+// operator new[] and the nothrow forms call this one, so they are counted too
+void* operator new(std::size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+#endif
+
+namespace transport_catalogue {
+namespace alloc_counter {
+
+using namespace std::literals;
+
+size_t GetAllocationCount() {
+#ifdef TRANSPORT_CATALOGUE_STATS
+    return allocation_count.load(std::memory_order_relaxed);
+#else
+    return 0;
+#endif
+}
+
+Scope::Scope(std::string_view name) : name_(name), start_(GetAllocationCount()) {
+}
+
+Scope::~Scope() {
+#ifdef TRANSPORT_CATALOGUE_STATS
+    std::cerr << name_ << ": "sv << GetAllocationCount() - start_ << " allocations\n"sv;
+#endif
+}
+
+}
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+namespace transport_catalogue {
+namespace alloc_counter {
+
+// Number of operator new calls made so far. They are counted only in a build
+// with TRANSPORT_CATALOGUE_STATS, otherwise it is always 0
+size_t GetAllocationCount();
+
+// With TRANSPORT_CATALOGUE_STATS prints to stderr how many allocations were made
+// between its construction and destruction, otherwise does nothing
+class Scope {
+public:
+    explicit Scope(std::string_view name);
+    ~Scope();
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    std::string_view name_;
+    size_t start_;
+};
+
+}
+}
@@ -0,0 +1,48 @@
+#include "flat_base.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace transport_catalogue {
+namespace flat_base {
+
+bool IsFlatBase(const char* data, size_t size) {
+    return size >= sizeof(Header) && std::memcmp(data, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+MappedFile::MappedFile(const std::string& file_name) {
+    const int fd = open(file_name.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw std::runtime_error("Cannot open base file " + file_name);
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1) {
+        close(fd);
+        throw std::runtime_error("Cannot stat base file " + file_name);
+    }
+    size_ = static_cast<size_t>(file_stat.st_size);
+    if (size_ > 0) {
+        void* data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("Cannot map base file " + file_name);
+        }
+        data_ = static_cast<const char*>(data);
+    }
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data_ != nullptr) {
+        munmap(const_cast<char*>(data_), size_);
+    }
+}
+
+}
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace transport_catalogue {
+
+// On-disk layout of the flat base. The file is a header, a table of sections
+// and the sections themselves, every section starts at an 8-byte aligned offset.
+// Numbers are stored in the host byte order.
+namespace flat_base {
+
+inline constexpr char MAGIC[8] = {'T', 'C', 'F', 'L', 'A', 'T', '0', '1'};
+inline constexpr uint32_t VERSION = 1;
+inline constexpr uint64_t ALIGNMENT = 8;
+
+enum class Section : uint32_t {
+    NAMES,       // names of stops and buses, not null-terminated
+    STOPS,       // Stop records, the position of a record is the stop id
+    BUSES,       // Bus records
+    BUS_STOPS,   // uint32_t stop ids of all buses, one after another
+    DISTANCES,   // Distance records sorted by (src, dst)
+    SETTINGS,    // protobuf TransportCatalogue message with settings only
+    COUNT
+};
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+};
+
+struct SectionEntry {
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct Stop {
+    double lat;
+    double lng;
+    uint32_t name_offset;
+    uint32_t name_size;
+};
+
+struct Bus {
+    uint32_t name_offset;
+    uint32_t name_size;
+    uint32_t stops_offset;
+    uint32_t stops_count;
+    uint32_t is_roundtrip;
+    uint32_t reserved;
+};
+
+struct Distance {
+    uint32_t src;
+    uint32_t dst;
+    int64_t distance;
+};
+
+inline constexpr uint64_t SECTIONS_OFFSET = sizeof(Header) + sizeof(SectionEntry) * static_cast<uint32_t>(Section::COUNT);
+
+bool IsFlatBase(const char* data, size_t size);
+
+// Read-only mapping of a whole file, an empty file is mapped as nullptr
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& file_name);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    const char* Data() const {
+        return data_;
+    }
+    size_t Size() const {
+        return size_;
+    }
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+}
+}
@@ -1,14 +1,17 @@
 #include "json.h"
 
+#include <array>
+#include <charconv>
+#include <cstring>
 #include <iterator>
+#include <system_error>
 
 namespace json {
 
 namespace {
 using namespace std::literals;
 
-Node LoadNode(std::istream& input);
-Node LoadString(std::istream& input);
+std::string ReadString(std::istream& input);
 
 std::string LoadLiteral(std::istream& input) {
     std::string s;
@@ -18,46 +21,7 @@ std::string LoadLiteral(std::istream& input) {
     return s;
 }
 
-Node LoadArray(std::istream& input) {
-    std::vector<Node> result;
-
-    for (char c; input >> c && c != ']';) {
-        if (c != ',') {
-            input.putback(c);
-        }
-        result.push_back(LoadNode(input));
-    }
-    if (!input) {
-        throw ParsingError("Array parsing error"s);
-    }
-    return Node(std::move(result));
-}
-
-Node LoadDict(std::istream& input) {
-    Dict dict;
-
-    for (char c; input >> c && c != '}';) {
-        if (c == '"') {
-            std::string key = LoadString(input).AsString();
-            if (input >> c && c == ':') {
-                if (dict.find(key) != dict.end()) {
-                    throw ParsingError("Duplicate key '"s + key + "' have been found");
-                }
-                dict.emplace(std::move(key), LoadNode(input));
-            } else {
-                throw ParsingError(": is expected but '"s + c + "' has been found"s);
-            }
-        } else if (c != ',') {
-            throw ParsingError(R"(',' is expected but ')"s + c + "' has been found"s);
-        }
-    }
-    if (!input) {
-        throw ParsingError("Dictionary parsing error"s);
-    }
-    return Node(std::move(dict));
-}
-
-Node LoadString(std::istream& input) {
+std::string ReadString(std::istream& input) {
     auto it = std::istreambuf_iterator<char>(input);
     auto end = std::istreambuf_iterator<char>();
     std::string s;
@@ -102,7 +66,7 @@ Node LoadString(std::istream& input) {
         ++it;
     }
 
-    return Node(std::move(s));
+    return s;
 }
 
 Node LoadBool(std::istream& input) {
@@ -124,32 +88,59 @@ Node LoadNull(std::istream& input) {
     }
 }
 
+// Символы числа копятся в буфере на стеке, и лишь слишком длинная запись уходит в строку
+class NumberChars {
+public:
+    void Push(char c) {
+        if (overflow_.empty() && size_ < buffer_.size()) {
+            buffer_[size_++] = c;
+            return;
+        }
+        if (overflow_.empty()) {
+            overflow_.assign(buffer_.data(), size_);
+        }
+        overflow_.push_back(c);
+    }
+
+    std::string_view View() const {
+        return overflow_.empty() ? std::string_view(buffer_.data(), size_) : std::string_view(overflow_);
+    }
+
+private:
+    std::array<char, 64> buffer_;
+    size_t size_ = 0;
+    std::string overflow_;
+};
+
 Node LoadNumber(std::istream& input) {
-    std::string parsed_num;
+    // Читаем напрямую из буфера потока, минуя sentry на каждый символ
+    std::streambuf& buf = *input.rdbuf();
+    NumberChars parsed_num;
+
+    auto is_digit = [](int ch) {
+        return ch >= '0' && ch <= '9';
+    };
 
     // Считывает в parsed_num очередной символ из input
-    auto read_char = [&parsed_num, &input] {
-        parsed_num += static_cast<char>(input.get());
-        if (!input) {
-            throw ParsingError("Failed to read number from stream"s);
-        }
+    auto read_char = [&parsed_num, &buf] {
+        parsed_num.Push(static_cast<char>(buf.sbumpc()));
     };
 
     // Считывает одну или более цифр в parsed_num из input
-    auto read_digits = [&input, read_char] {
-        if (!std::isdigit(input.peek())) {
+    auto read_digits = [&buf, is_digit, read_char] {
+        if (!is_digit(buf.sgetc())) {
             throw ParsingError("A digit is expected"s);
         }
-        while (std::isdigit(input.peek())) {
+        while (is_digit(buf.sgetc())) {
             read_char();
         }
     };
 
-    if (input.peek() == '-') {
+    if (buf.sgetc() == '-') {
         read_char();
     }
     // Парсим целую часть числа
-    if (input.peek() == '0') {
+    if (buf.sgetc() == '0') {
         read_char();
         // После 0 в JSON не могут идти другие цифры
     } else {
@@ -158,194 +149,289 @@ Node LoadNumber(std::istream& input) {
 
     bool is_int = true;
     // Парсим дробную часть числа
-    if (input.peek() == '.') {
+    if (buf.sgetc() == '.') {
         read_char();
         read_digits();
         is_int = false;
     }
 
     // Парсим экспоненциальную часть числа
-    if (int ch = input.peek(); ch == 'e' || ch == 'E') {
+    if (int ch = buf.sgetc(); ch == 'e' || ch == 'E') {
         read_char();
-        if (ch = input.peek(); ch == '+' || ch == '-') {
+        if (ch = buf.sgetc(); ch == '+' || ch == '-') {
             read_char();
         }
         read_digits();
         is_int = false;
     }
 
-    try {
-        if (is_int) {
-            // Сначала пробуем преобразовать строку в int
-            try {
-                return std::stoi(parsed_num);
-            } catch (...) {
-                // В случае неудачи, например, при переполнении
-                // код ниже попробует преобразовать строку в double
+    const std::string_view num = parsed_num.View();
+    const char* const first = num.data();
+    const char* const last = num.data() + num.size();
+    if (is_int) {
+        // Сначала пробуем преобразовать строку в int.
+        // При переполнении код ниже преобразует её в double
+        int value;
+        if (const auto [ptr, ec] = std::from_chars(first, last, value); ec == std::errc{} && ptr == last) {
+            return value;
+        }
+    }
+    double value;
+    if (const auto [ptr, ec] = std::from_chars(first, last, value); ec == std::errc{} && ptr == last) {
+        return value;
+    }
+    throw ParsingError("Failed to convert "s + std::string(num) + " to number"s);
+}
+
+void ParseNode(std::istream& input, Handler& handler);
+
+// Дописывает в text исходный текст очередного значения, не разбирая его.
+// Следит только за вложенностью скобок и строками, чтобы найти конец значения.
+// Читает поток посимвольно, для текста в памяти есть TakeRawValue
+void ReadRawValue(std::istream& input, std::string& text) {
+    input >> std::ws;
+    std::streambuf& buf = *input.rdbuf();
+    int depth = 0;
+    bool in_string = false;
+    for (int ch = buf.sgetc();; ch = buf.sgetc()) {
+        if (ch == std::char_traits<char>::eof()) {
+            throw ParsingError("Unexpected EOF"s);
+        }
+        if (in_string) {
+            if (ch == '\\') {
+                text.push_back(static_cast<char>(buf.sbumpc()));
+                ch = buf.sgetc();
+                if (ch == std::char_traits<char>::eof()) {
+                    throw ParsingError("String parsing error"s);
+                }
+            } else if (ch == '"') {
+                in_string = false;
+            }
+        } else if (ch == '"') {
+            in_string = true;
+        } else if (ch == '[' || ch == '{') {
+            ++depth;
+        } else if (ch == ']' || ch == '}' || ch == ',') {
+            if (depth == 0) {
+                return;
+            }
+            if (ch != ',') {
+                --depth;
             }
         }
-        return std::stod(parsed_num);
-    } catch (...) {
-        throw ParsingError("Failed to convert "s + parsed_num + " to number"s);
+        text.push_back(static_cast<char>(buf.sbumpc()));
     }
 }
 
-Node LoadNode(std::istream& input) {
+// Длина значения в начале text, правила те же, что у ReadRawValue.
+// Конец строки ищется через memchr, кавычка после нечётного числа \ экранирована
+size_t FindValueEnd(std::string_view text) {
+    const char* const begin = text.data();
+    const char* const end = begin + text.size();
+    int depth = 0;
+    for (const char* it = begin; it != end; ++it) {
+        switch (*it) {
+            case '"':
+                for (;;) {
+                    it = static_cast<const char*>(std::memchr(it + 1, '"', end - it - 1));
+                    if (!it) {
+                        throw ParsingError("String parsing error"s);
+                    }
+                    const char* escapes = it;
+                    while (escapes[-1] == '\\') {
+                        --escapes;
+                    }
+                    if ((it - escapes) % 2 == 0) {
+                        break;
+                    }
+                }
+                break;
+            case '[':
+            case '{':
+                ++depth;
+                break;
+            case ']':
+            case '}':
+                if (depth-- == 0) {
+                    return it - begin;
+                }
+                break;
+            case ',':
+                if (depth == 0) {
+                    return it - begin;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    throw ParsingError("Unexpected EOF"s);
+}
+
+// Исходный текст очередного значения как часть текста буфера, без копирования
+std::string_view TakeRawValue(std::istream& input, MemoryStreambuf& buf) {
+    input >> std::ws;
+    const std::string_view rest = buf.GetRest();
+    const size_t size = FindValueEnd(rest);
+    buf.Skip(size);
+    return rest.substr(0, size);
+}
+
+void ParseArray(std::istream& input, Handler& handler) {
+    handler.StartArray();
+    const bool raw_items = handler.RawItems();
+    MemoryStreambuf* memory = raw_items ? dynamic_cast<MemoryStreambuf*>(input.rdbuf()) : nullptr;
+    std::string text;
+    for (char c; input >> c && c != ']';) {
+        if (c != ',') {
+            input.putback(c);
+        }
+        if (memory) {
+            handler.RawValue(TakeRawValue(input, *memory));
+        } else if (raw_items) {
+            text.clear();
+            ReadRawValue(input, text);
+            handler.RawValue(text);
+        } else {
+            ParseNode(input, handler);
+        }
+    }
+    if (!input) {
+        throw ParsingError("Array parsing error"s);
+    }
+    handler.EndArray();
+}
+
+// Не хранит уже встреченные ключи,
+// поэтому проверка дубликатов остаётся за обработчиком
+void ParseDict(std::istream& input, Handler& handler) {
+    handler.StartDict();
+    for (char c; input >> c && c != '}';) {
+        if (c == '"') {
+            std::string key = ReadString(input);
+            if (input >> c && c == ':') {
+                handler.Key(std::move(key));
+                ParseNode(input, handler);
+            } else {
+                throw ParsingError(": is expected but '"s + c + "' has been found"s);
+            }
+        } else if (c != ',') {
+            throw ParsingError(R"(',' is expected but ')"s + c + "' has been found"s);
+        }
+    }
+    if (!input) {
+        throw ParsingError("Dictionary parsing error"s);
+    }
+    handler.EndDict();
+}
+
+void ParseNode(std::istream& input, Handler& handler) {
     char c;
     if (!(input >> c)) {
         throw ParsingError("Unexpected EOF"s);
     }
     switch (c) {
         case '[':
-            return LoadArray(input);
+            ParseArray(input, handler);
+            break;
         case '{':
-            return LoadDict(input);
+            ParseDict(input, handler);
+            break;
         case '"':
-            return LoadString(input);
+            handler.Value(ReadString(input));
+            break;
         case 't':
-            // Атрибут [[fallthrough]] (провалиться) ничего не делает, и является
-            // подсказкой компилятору и человеку, что здесь программист явно задумывал
-            // разрешить переход к инструкции следующей ветки case, а не случайно забыл
-            // написать break, return или throw.
-            // В данном случае, встретив t или f, переходим к попытке парсинга
-            // литералов true либо false
             [[fallthrough]];
         case 'f':
             input.putback(c);
-            return LoadBool(input);
+            handler.Value(LoadBool(input).GetValue());
+            break;
         case 'n':
             input.putback(c);
-            return LoadNull(input);
+            handler.Value(LoadNull(input).GetValue());
+            break;
         default:
             input.putback(c);
-            return LoadNumber(input);
+            handler.Value(LoadNumber(input).GetValue());
+            break;
     }
 }
 
-struct PrintContext {
-    std::ostream& out;
-    int indent_step = 4;
-    int indent = 0;
-
-    void PrintIndent() const {
-        for (int i = 0; i < indent; ++i) {
-            out.put(' ');
-        }
-    }
+}  // namespace
 
-    PrintContext Indented() const {
-        return {out, indent_step, indent_step + indent};
-    }
-};
+void Parse(std::istream& input, Handler& handler) {
+    ParseNode(input, handler);
+}
 
-void PrintNode(const Node& value, const PrintContext& ctx);
+void PrintNumber(int value, std::ostream& out) {
+    std::array<char, 16> buffer;
+    const auto [end, ec] = std::to_chars(buffer.data(), buffer.data() + buffer.size(), value);
+    out.write(buffer.data(), end - buffer.data());
+}
 
-template <typename Value>
-void PrintValue(const Value& value, const PrintContext& ctx) {
-    ctx.out << value;
+void PrintNumber(double value, std::ostream& out) {
+    // Формат совпадает с operator<< при флагах по умолчанию: %g с точностью потока
+    std::array<char, 64> buffer;
+    const auto [end, ec] = std::to_chars(buffer.data(), buffer.data() + buffer.size(), value,
+                                         std::chars_format::general, static_cast<int>(out.precision()));
+    if (ec != std::errc{}) {
+        out << value;
+        return;
+    }
+    out.write(buffer.data(), end - buffer.data());
 }
 
-void PrintString(const std::string& value, std::ostream& out) {
-    out.put('"');
-    for (const char c : value) {
-        switch (c) {
+namespace {
+
+// Выводит value с экранированием. Участки без спецсимволов пишутся в поток целиком
+void WriteEscaped(std::string_view value, std::ostream& out) {
+    using namespace std::literals;
+    size_t run_start = 0;
+    for (size_t i = 0; i < value.size(); ++i) {
+        std::string_view escaped;
+        switch (value[i]) {
             case '\r':
-                out << "\\r"sv;
+                escaped = "\\r"sv;
                 break;
             case '\n':
-                out << "\\n"sv;
+                escaped = "\\n"sv;
                 break;
             case '"':
                 // Символы " и \ выводятся как \" или \\, соответственно
-                [[fallthrough]];
+                escaped = "\\\""sv;
+                break;
             case '\\':
-                out.put('\\');
-                [[fallthrough]];
-            default:
-                out.put(c);
+                escaped = "\\\\"sv;
                 break;
+            default:
+                continue;
         }
+        out.write(value.data() + run_start, i - run_start);
+        out.write(escaped.data(), escaped.size());
+        run_start = i + 1;
     }
-    out.put('"');
-}
-
-template <>
-void PrintValue<std::string>(const std::string& value, const PrintContext& ctx) {
-    PrintString(value, ctx.out);
+    out.write(value.data() + run_start, value.size() - run_start);
 }
 
-template <>
-void PrintValue<std::nullptr_t>(const std::nullptr_t&, const PrintContext& ctx) {
-    ctx.out << "null"sv;
-}
-
-// В специализаци шаблона PrintValue для типа bool параметр value передаётся
-// по константной ссылке, как и в основном шаблоне.
-// В качестве альтернативы можно использовать перегрузку:
-// void PrintValue(bool value, const PrintContext& ctx);
-template <>
-void PrintValue<bool>(const bool& value, const PrintContext& ctx) {
-    ctx.out << (value ? "true"sv : "false"sv);
-}
+}  // namespace
 
-template <>
-void PrintValue<Array>(const Array& nodes, const PrintContext& ctx) {
-    std::ostream& out = ctx.out;
-    out << "[\n"sv;
-    bool first = true;
-    auto inner_ctx = ctx.Indented();
-    for (const Node& node : nodes) {
-        if (first) {
-            first = false;
-        } else {
-            out << ",\n"sv;
-        }
-        inner_ctx.PrintIndent();
-        PrintNode(node, inner_ctx);
-    }
-    out.put('\n');
-    ctx.PrintIndent();
-    out.put(']');
+void PrintString(std::string_view value, std::ostream& out) {
+    out.put('"');
+    WriteEscaped(value, out);
+    out.put('"');
 }
 
-template <>
-void PrintValue<Dict>(const Dict& nodes, const PrintContext& ctx) {
-    std::ostream& out = ctx.out;
-    out << "{\n"sv;
-    bool first = true;
-    auto inner_ctx = ctx.Indented();
-    for (const auto& [key, node] : nodes) {
-        if (first) {
-            first = false;
-        } else {
-            out << ",\n"sv;
-        }
-        inner_ctx.PrintIndent();
-        PrintString(key, ctx.out);
-        out << ": "sv;
-        PrintNode(node, inner_ctx);
+EscapingStreambuf::int_type EscapingStreambuf::overflow(int_type ch) {
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        const char c = traits_type::to_char_type(ch);
+        WriteEscaped({&c, 1}, output_);
     }
-    out.put('\n');
-    ctx.PrintIndent();
-    out.put('}');
-}
-
-void PrintNode(const Node& node, const PrintContext& ctx) {
-    std::visit(
-        [&ctx](const auto& value) {
-            PrintValue(value, ctx);
-        },
-        node.GetValue());
-}
-
-}  // namespace
-
-Document Load(std::istream& input) {
-    return Document{LoadNode(input)};
+    return output_ ? traits_type::not_eof(ch) : traits_type::eof();
 }
 
-void Print(const Document& doc, std::ostream& output) {
-    PrintNode(doc.GetRoot(), PrintContext{output});
+std::streamsize EscapingStreambuf::xsputn(const char* s, std::streamsize count) {
+    WriteEscaped({s, static_cast<size_t>(count)}, output_);
+    return output_ ? count : 0;
 }
 
 }  // namespace json
@@ -1,15 +1,56 @@
 #pragma once
 
+#include <algorithm>
+#include <initializer_list>
 #include <iostream>
-#include <map>
+#include <streambuf>
 #include <string>
+#include <string_view>
+#include <tuple>
 #include <variant>
 #include <vector>
 
 namespace json {
 
 class Node;
-using Dict = std::map<std::string, Node>;
+
+// Словарь, хранящий пары в векторе, отсортированном по ключу.
+// Повторяет ту часть интерфейса std::map, которой пользуются модули справочника
+class Dict {
+public:
+    using value_type = std::pair<std::string, Node>;
+    using Items = std::vector<value_type>;
+    using iterator = Items::iterator;
+    using const_iterator = Items::const_iterator;
+
+    Dict() = default;
+    Dict(std::initializer_list<std::pair<std::string_view, Node>> items);
+
+    const Node& at(std::string_view key) const;
+    Node& operator[](std::string_view key);
+    // Вставляет пару, если ключа ещё нет. Как и у std::map, second == false для существующего ключа
+    std::pair<iterator, bool> emplace(std::string_view key, Node value);
+
+    iterator find(std::string_view key);
+    const_iterator find(std::string_view key) const;
+    size_t count(std::string_view key) const;
+
+    iterator begin() { return items_.begin(); }
+    iterator end() { return items_.end(); }
+    const_iterator begin() const { return items_.begin(); }
+    const_iterator end() const { return items_.end(); }
+    size_t size() const { return items_.size(); }
+    bool empty() const { return items_.empty(); }
+
+    bool operator==(const Dict& rhs) const;
+
+private:
+    iterator LowerBound(std::string_view key);
+    const_iterator LowerBound(std::string_view key) const;
+
+    Items items_;
+};
+
 using Array = std::vector<Node>;
 using Data = std::variant<std::nullptr_t, Array, Dict, bool, int, double, std::string>;
 
@@ -24,7 +65,7 @@ public:
     using variant::variant;
     using Value = variant;
     
-    Node(Value value) : Data(value) {
+    Node(Value value) : Data(std::move(value)) {
         
     }
     bool IsInt() const {
@@ -117,30 +158,133 @@ inline bool operator!=(const Node& lhs, const Node& rhs) {
     return !(lhs == rhs);
 }
 
-class Document {
-public:
-    explicit Document(Node root)
-        : root_(std::move(root)) {
+inline Dict::Dict(std::initializer_list<std::pair<std::string_view, Node>> items) {
+    for (const auto& [key, value] : items) {
+        emplace(key, value);
     }
+}
 
-    const Node& GetRoot() const {
-        return root_;
+inline Dict::iterator Dict::LowerBound(std::string_view key) {
+    return std::lower_bound(items_.begin(), items_.end(), key, [](const value_type& item, std::string_view key) {
+        return std::string_view(item.first) < key;
+    });
+}
+
+inline Dict::const_iterator Dict::LowerBound(std::string_view key) const {
+    return std::lower_bound(items_.begin(), items_.end(), key, [](const value_type& item, std::string_view key) {
+        return std::string_view(item.first) < key;
+    });
+}
+
+inline Dict::iterator Dict::find(std::string_view key) {
+    const auto it = LowerBound(key);
+    return it != items_.end() && it->first == key ? it : items_.end();
+}
+
+inline Dict::const_iterator Dict::find(std::string_view key) const {
+    const auto it = LowerBound(key);
+    return it != items_.end() && it->first == key ? it : items_.end();
+}
+
+inline size_t Dict::count(std::string_view key) const {
+    return find(key) != items_.end() ? 1 : 0;
+}
+
+inline const Node& Dict::at(std::string_view key) const {
+    using namespace std::literals;
+    const auto it = find(key);
+    if (it == items_.end()) {
+        throw std::out_of_range("No key '"s + std::string(key) + "' in dict"s);
     }
+    return it->second;
+}
 
-private:
-    Node root_;
-};
+inline std::pair<Dict::iterator, bool> Dict::emplace(std::string_view key, Node value) {
+    const auto it = LowerBound(key);
+    if (it != items_.end() && it->first == key) {
+        return {it, false};
+    }
+    return {items_.emplace(it, std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::move(value))), true};
+}
 
-inline bool operator==(const Document& lhs, const Document& rhs) {
-    return lhs.GetRoot() == rhs.GetRoot();
+inline Node& Dict::operator[](std::string_view key) {
+    return emplace(key, Node{}).first->second;
 }
 
-inline bool operator!=(const Document& lhs, const Document& rhs) {
-    return !(lhs == rhs);
+inline bool Dict::operator==(const Dict& rhs) const {
+    return items_ == rhs.items_;
 }
 
-Document Load(std::istream& input);
+// Обработчик событий потокового разбора JSON.
+// Parse вызывает методы в порядке следования токенов в документе,
+// не строя дерево Node целиком
+class Handler {
+public:
+    virtual void StartDict() = 0;
+    virtual void Key(std::string key) = 0;
+    virtual void EndDict() = 0;
+    virtual void StartArray() = 0;
+    virtual void EndArray() = 0;
+    virtual void Value(Node::Value value) = 0;
+
+    // Вызывается сразу после StartArray. Если вернуть true, элементы массива
+    // не разбираются, а передаются в RawValue исходным текстом.
+    // При разборе из MemoryStreambuf text - часть его текста и действителен, пока жив текст,
+    // иначе только до возврата из RawValue
+    virtual bool RawItems() {
+        return false;
+    }
+    virtual void RawValue(std::string_view /*text*/) {
+    }
+protected:
+    ~Handler() = default;
+};
+
+void Parse(std::istream& input, Handler& handler);
+
+// Буфер потока, читающий текст в памяти без копирования. Parse находит границы
+// элементов для RawValue одним проходом по этому тексту, а не посимвольно через поток
+class MemoryStreambuf final : public std::streambuf {
+public:
+    explicit MemoryStreambuf(std::string_view text = {}) {
+        Reset(text);
+    }
+
+    void Reset(std::string_view text) {
+        char* begin = const_cast<char*>(text.data());
+        setg(begin, begin, begin + text.size());
+    }
 
-void Print(const Document& doc, std::ostream& output);
+    // Ещё не прочитанная часть текста
+    std::string_view GetRest() const {
+        return {gptr(), static_cast<size_t>(egptr() - gptr())};
+    }
+
+    void Skip(size_t count) {
+        setg(eback(), gptr() + count, egptr());
+    }
+};
+
+// Выводят число так же, как operator<< с настройками потока по умолчанию
+void PrintNumber(int value, std::ostream& output);
+void PrintNumber(double value, std::ostream& output);
+
+// Выводит строку в кавычках, экранируя спецсимволы
+void PrintString(std::string_view value, std::ostream& output);
+
+// Буфер потока, который экранирует записанные в него символы по правилам строк JSON
+// и сразу передаёт их в output. Кавычки вокруг строки не выводит
+class EscapingStreambuf final : public std::streambuf {
+public:
+    explicit EscapingStreambuf(std::ostream& output) : output_(output) {
+    }
+
+protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char* s, std::streamsize count) override;
+
+private:
+    std::ostream& output_;
+};
 
 }  // namespace json
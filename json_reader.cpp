@@ -1,10 +1,20 @@
 #include "json_reader.h"
 #include "json_builder.h"
+#include "json_writer.h"
 #include "request_handler.h"
 #include "serialization.h"
 #include "transport_router.h"
 
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <deque>
+#include <functional>
+#include <future>
 #include <map>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
 #include <string_view>
 #include <vector>
 
@@ -13,40 +23,498 @@ namespace json_reader{
 
 using namespace std::literals;
 
-Stop GetStopFromDict(const json::Dict& stop_dict) {
-    return {stop_dict.at("name").AsString(), stop_dict.at("latitude").AsDouble(), stop_dict.at("longitude").AsDouble()};
+// Collects every top-level value it receives into a json::Node
+class NodeCollector final : public json::Handler {
+public:
+    using Callback = std::function<void(json::Node)>;
+
+    explicit NodeCollector(Callback on_node) : on_node_(std::move(on_node)) {
+    }
+    void StartDict() override {
+        builder_.StartDict();
+        ++depth_;
+    }
+    void Key(std::string key) override {
+        builder_.Key(std::move(key));
+    }
+    void EndDict() override {
+        builder_.EndDict();
+        Finish();
+    }
+    void StartArray() override {
+        builder_.StartArray();
+        ++depth_;
+    }
+    void EndArray() override {
+        builder_.EndArray();
+        Finish();
+    }
+    void Value(json::Node::Value value) override {
+        if (depth_ == 0) {
+            on_node_(json::Node(std::move(value)));
+        } else {
+            builder_.Value(std::move(value));
+        }
+    }
+private:
+    void Finish() {
+        if (--depth_ == 0) {
+            on_node_(builder_.Build());
+            builder_ = json::Builder{};
+        }
+    }
+
+    Callback on_node_;
+    json::Builder builder_;
+    int depth_ = 0;
+};
+
+// Passes elements of a top-level array one by one to item_handler
+class ArrayItems final : public json::Handler {
+public:
+    ArrayItems(json::Handler& item_handler, std::function<void()> on_start = {})
+        : item_handler_(item_handler), on_start_(std::move(on_start)) {
+    }
+    void StartDict() override {
+        CheckInArray();
+        ++depth_;
+        item_handler_.StartDict();
+    }
+    void Key(std::string key) override {
+        item_handler_.Key(std::move(key));
+    }
+    void EndDict() override {
+        --depth_;
+        item_handler_.EndDict();
+    }
+    void StartArray() override {
+        if (depth_++ == 0) {
+            if (on_start_) {
+                on_start_();
+            }
+        } else {
+            item_handler_.StartArray();
+        }
+    }
+    void EndArray() override {
+        if (--depth_ > 0) {
+            item_handler_.EndArray();
+        }
+    }
+    void Value(json::Node::Value value) override {
+        CheckInArray();
+        item_handler_.Value(std::move(value));
+    }
+    bool RawItems() override {
+        return depth_ > 1 && item_handler_.RawItems();
+    }
+    void RawValue(std::string_view text) override {
+        item_handler_.RawValue(text);
+    }
+private:
+    void CheckInArray() const {
+        if (depth_ == 0) {
+            throw std::logic_error("Not an array"s);
+        }
+    }
+
+    json::Handler& item_handler_;
+    std::function<void()> on_start_;
+    int depth_ = 0;
+};
+
+// Routes the value of every section of the root dict to its own handler,
+// sections without a handler are skipped
+class SectionDispatcher final : public json::Handler {
+public:
+    void On(std::string section, json::Handler& handler) {
+        handlers_[std::move(section)] = &handler;
+    }
+    void StartDict() override {
+        if (depth_++ > 0 && current_) {
+            current_->StartDict();
+        }
+    }
+    void Key(std::string key) override {
+        if (depth_ == 1) {
+            const auto it = handlers_.find(key);
+            current_ = it != handlers_.end() ? it->second : nullptr;
+        } else if (current_) {
+            current_->Key(std::move(key));
+        }
+    }
+    void EndDict() override {
+        if (--depth_ > 0 && current_) {
+            current_->EndDict();
+        }
+    }
+    void StartArray() override {
+        CheckInDict();
+        if (depth_++ > 0 && current_) {
+            current_->StartArray();
+        }
+    }
+    void EndArray() override {
+        if (--depth_ > 0 && current_) {
+            current_->EndArray();
+        }
+    }
+    void Value(json::Node::Value value) override {
+        CheckInDict();
+        if (current_) {
+            current_->Value(std::move(value));
+        }
+    }
+    bool RawItems() override {
+        return depth_ > 1 && current_ && current_->RawItems();
+    }
+    void RawValue(std::string_view text) override {
+        if (current_) {
+            current_->RawValue(text);
+        }
+    }
+private:
+    void CheckInDict() const {
+        if (depth_ == 0) {
+            throw std::logic_error("Not a dict"s);
+        }
+    }
+
+    std::map<std::string, json::Handler*, std::less<>> handlers_;
+    json::Handler* current_ = nullptr;
+    int depth_ = 0;
+};
+
+enum class RequestType {
+    BUS,
+    MAP,
+    MAP_TILE,
+    ROUTE,
+    STOP,
+    UNKNOWN
+};
+
+enum class RequestField {
+    BBOX,
+    FROM,
+    ID,
+    IS_ROUNDTRIP,
+    LATITUDE,
+    LONGITUDE,
+    NAME,
+    OVERLAY,
+    ROAD_DISTANCES,
+    STOPS,
+    TO,
+    TYPE,
+    X,
+    Y,
+    ZOOM,
+    UNKNOWN
+};
+
+// Both tables are sorted by key for FindInTable
+constexpr std::array<std::pair<std::string_view, RequestType>, 5> REQUEST_TYPES{{
+    {"Bus"sv, RequestType::BUS},
+    {"Map"sv, RequestType::MAP},
+    {"MapTile"sv, RequestType::MAP_TILE},
+    {"Route"sv, RequestType::ROUTE},
+    {"Stop"sv, RequestType::STOP},
+}};
+
+constexpr std::array<std::pair<std::string_view, RequestField>, 15> REQUEST_FIELDS{{
+    {"bbox"sv, RequestField::BBOX},
+    {"from"sv, RequestField::FROM},
+    {"id"sv, RequestField::ID},
+    {"is_roundtrip"sv, RequestField::IS_ROUNDTRIP},
+    {"latitude"sv, RequestField::LATITUDE},
+    {"longitude"sv, RequestField::LONGITUDE},
+    {"name"sv, RequestField::NAME},
+    {"overlay"sv, RequestField::OVERLAY},
+    {"road_distances"sv, RequestField::ROAD_DISTANCES},
+    {"stops"sv, RequestField::STOPS},
+    {"to"sv, RequestField::TO},
+    {"type"sv, RequestField::TYPE},
+    {"x"sv, RequestField::X},
+    {"y"sv, RequestField::Y},
+    {"zoom"sv, RequestField::ZOOM},
+}};
+
+template <typename Value, size_t N>
+Value FindInTable(const std::array<std::pair<std::string_view, Value>, N>& table, std::string_view key, Value not_found) {
+    const auto it = std::lower_bound(table.begin(), table.end(), key, [](const auto& item, std::string_view key) {
+        return item.first < key;
+    });
+    return it != table.end() && it->first == key ? it->second : not_found;
 }
 
-std::vector<std::string_view> GetAllStops(const json::Dict& bus_dict) {
-    std::vector<std::string_view> result;
-    for (const auto& stop : bus_dict.at("stops").AsArray()) {
-        result.push_back(stop.AsString());
+// Every field a base or a stat request may carry
+struct RawRequest {
+    RequestType type = RequestType::UNKNOWN;
+    int id = 0;
+    std::string name;
+    std::string from;
+    std::string to;
+    detail::Coordinates coordinates = {0, 0};
+    std::vector<std::pair<std::string, int>> road_distances;
+    std::vector<std::string> stops;
+    bool is_roundtrip = false;
+    bool overlay = false;
+    std::optional<int> zoom;
+    renderer::MapTile tile;
+    std::vector<double> bbox;
+};
+
+std::string TakeString(json::Node::Value& value) {
+    if (std::string* str = std::get_if<std::string>(&value)) {
+        return std::move(*str);
     }
-    return result;
+    throw std::logic_error("Not a string"s);
 }
 
-Bus GetBusFromDict(TransportCatalogue& catalogue, const json::Dict& bus_dict) {
-    Bus bus;
-    bus.name = bus_dict.at("name").AsString();
-    for (const std::string_view bus_stop : GetAllStops(bus_dict)) {
-        bus.stops.push_back(catalogue.GetStopByName(bus_stop));
+// Decodes a sequence of top-level request dicts straight from parser events,
+// unknown fields are skipped
+class RequestDecoder final : public json::Handler {
+public:
+    using Callback = std::function<void(RawRequest)>;
+
+    explicit RequestDecoder(Callback on_request) : on_request_(std::move(on_request)) {
     }
-    bus.is_roundtrip = bus_dict.at("is_roundtrip").AsBool();
-    return bus;
+    // id of the request being decoded, if its id field has been met already
+    std::optional<int> GetId() const {
+        return has_id_ ? std::optional<int>(request_.id) : std::nullopt;
+    }
+    void StartDict() override {
+        if (depth_ == 0) {
+            request_ = RawRequest{};
+            has_type_ = false;
+            has_id_ = false;
+        } else if (depth_ == 1) {
+            nested_field_ = field_ == RequestField::ROAD_DISTANCES ? field_ : RequestField::UNKNOWN;
+        }
+        ++depth_;
+    }
+    void Key(std::string key) override {
+        if (depth_ == 1) {
+            field_ = FindInTable(REQUEST_FIELDS, key, RequestField::UNKNOWN);
+        } else if (depth_ == 2) {
+            distance_stop_ = std::move(key);
+        }
+    }
+    void EndDict() override {
+        if (--depth_ == 0) {
+            if (!has_type_) {
+                throw std::logic_error("Request type is missing"s);
+            }
+            on_request_(std::move(request_));
+        }
+    }
+    void StartArray() override {
+        CheckInDict();
+        if (depth_ == 1) {
+            nested_field_ = field_ == RequestField::STOPS || field_ == RequestField::BBOX ? field_ : RequestField::UNKNOWN;
+        }
+        ++depth_;
+    }
+    void EndArray() override {
+        --depth_;
+    }
+    void Value(json::Node::Value value) override {
+        CheckInDict();
+        if (depth_ == 1) {
+            SetField(value);
+        } else if (depth_ == 2 && nested_field_ == RequestField::STOPS) {
+            request_.stops.push_back(TakeString(value));
+        } else if (depth_ == 2 && nested_field_ == RequestField::BBOX) {
+            request_.bbox.push_back(json::Node(std::move(value)).AsDouble());
+        } else if (depth_ == 2 && nested_field_ == RequestField::ROAD_DISTANCES) {
+            request_.road_distances.emplace_back(std::move(distance_stop_), json::Node(std::move(value)).AsInt());
+        }
+    }
+private:
+    void CheckInDict() const {
+        if (depth_ == 0) {
+            throw std::logic_error("Not a dict"s);
+        }
+    }
+
+    void SetField(json::Node::Value& value) {
+        switch (field_) {
+            case RequestField::TYPE:
+                request_.type = FindInTable(REQUEST_TYPES, TakeString(value), RequestType::UNKNOWN);
+                has_type_ = true;
+                break;
+            case RequestField::ID:
+                request_.id = json::Node(std::move(value)).AsInt();
+                has_id_ = true;
+                break;
+            case RequestField::NAME:
+                request_.name = TakeString(value);
+                break;
+            case RequestField::FROM:
+                request_.from = TakeString(value);
+                break;
+            case RequestField::TO:
+                request_.to = TakeString(value);
+                break;
+            case RequestField::LATITUDE:
+                request_.coordinates.lat = json::Node(std::move(value)).AsDouble();
+                break;
+            case RequestField::LONGITUDE:
+                request_.coordinates.lng = json::Node(std::move(value)).AsDouble();
+                break;
+            case RequestField::IS_ROUNDTRIP:
+                request_.is_roundtrip = json::Node(std::move(value)).AsBool();
+                break;
+            case RequestField::OVERLAY:
+                request_.overlay = json::Node(std::move(value)).AsBool();
+                break;
+            case RequestField::ZOOM:
+                request_.zoom = json::Node(std::move(value)).AsInt();
+                break;
+            case RequestField::X:
+                request_.tile.x = json::Node(std::move(value)).AsInt();
+                break;
+            case RequestField::Y:
+                request_.tile.y = json::Node(std::move(value)).AsInt();
+                break;
+            default:
+                break;
+        }
+    }
+
+    Callback on_request_;
+    RawRequest request_;
+    bool has_type_ = false;
+    bool has_id_ = false;
+    RequestField field_ = RequestField::UNKNOWN;
+    RequestField nested_field_ = RequestField::UNKNOWN;
+    std::string distance_stop_;
+    int depth_ = 0;
+};
+
+// Cuts a top-level array into chunks of items and decodes every chunk on its own thread.
+// Items are views of input, so the array must be parsed from a json::MemoryStreambuf over it.
+// Decoded requests reach on_request strictly in document order
+class ParallelRequestDecoder final : public json::Handler {
+public:
+    ParallelRequestDecoder(unsigned threads, std::string_view input, RequestDecoder::Callback on_request)
+        : threads_(threads), input_(input), on_request_(std::move(on_request)) {
+    }
+    void StartDict() override {
+        throw std::logic_error("Not an array"s);
+    }
+    void Key(std::string) override {
+    }
+    void EndDict() override {
+    }
+    void StartArray() override {
+        ++depth_;
+    }
+    void EndArray() override {
+        if (--depth_ == 0) {
+            Submit();
+            while (!chunks_.empty()) {
+                Collect();
+            }
+        }
+    }
+    void Value(json::Node::Value) override {
+        throw std::logic_error("Not an array"s);
+    }
+    bool RawItems() override {
+        return depth_ == 1;
+    }
+    void RawValue(std::string_view text) override {
+        const std::less<const char*> less;
+        if (less(text.data(), input_.data()) || less(input_.data() + input_.size(), text.data() + text.size())) {
+            throw std::logic_error("Raw item is not a part of the input"s);
+        }
+        chunk_.push_back(text);
+        if (chunk_.size() == CHUNK_SIZE) {
+            Submit();
+        }
+    }
+private:
+    static const size_t CHUNK_SIZE = 1024;
+
+    static std::vector<RawRequest> DecodeChunk(const std::vector<std::string_view>& chunk) {
+        std::vector<RawRequest> result;
+        RequestDecoder decoder([&result](RawRequest request) {
+            result.push_back(std::move(request));
+        });
+        json::MemoryStreambuf buf;
+        std::istream input(&buf);
+        for (std::string_view item : chunk) {
+            buf.Reset(item);
+            input.clear();
+            json::Parse(input, decoder);
+        }
+        return result;
+    }
+
+    void Submit() {
+        if (chunk_.empty()) {
+            return;
+        }
+        // at most threads_ chunks are decoded at once, it also bounds memory
+        if (chunks_.size() >= threads_) {
+            Collect();
+        }
+        chunks_.push_back(std::async(std::launch::async, [chunk = std::move(chunk_)] {
+            return DecodeChunk(chunk);
+        }));
+        chunk_.clear();
+    }
+
+    void Collect() {
+        for (RawRequest& request : chunks_.front().get()) {
+            on_request_(std::move(request));
+        }
+        chunks_.pop_front();
+    }
+
+    unsigned threads_;
+    std::string_view input_;
+    RequestDecoder::Callback on_request_;
+    std::deque<std::future<std::vector<RawRequest>>> chunks_;
+    std::vector<std::string_view> chunk_;
+    int depth_ = 0;
+};
+
+// the whole input in one buffer
+std::string ReadAll(std::istream& input) {
+    std::string text;
+    std::array<char, 1 << 16> block;
+    while (input.read(block.data(), block.size()) || input.gcount() > 0) {
+        text.append(block.data(), static_cast<size_t>(input.gcount()));
+    }
+    return text;
 }
 
-void SetRealDistanceForStopFromRequest(TransportCatalogue& catalogue, const json::Dict& stop_dict) {
-    std::string stop_name = stop_dict.at("name").AsString();
-    const Stop* src_stop = catalogue.GetStopByName(stop_name);
-    for (const auto& [stop, distance] : stop_dict.at("road_distances").AsDict()) {
+void SetRealDistanceForStopFromRequest(TransportCatalogue& catalogue, const StopRequest& request) {
+    const Stop* src_stop = catalogue.GetStopByName(request.name);
+    for (const auto& [stop, distance] : request.road_distances) {
         const Stop* dst_stop = catalogue.GetStopByName(stop);
-        catalogue.SetDistanceBetweenStops(src_stop, dst_stop, distance.AsInt());
+        catalogue.SetDistanceBetweenStops(src_stop, dst_stop, distance);
     }
 }
 
-void GetBusDictFromBusInfo(json::Builder& builder, const std::optional<BusInfo>& bus_info, int request_id) {
+Bus GetBusFromRequest(TransportCatalogue& catalogue, const BusRequest& request) {
+    Bus bus;
+    bus.name = request.name;
+    for (const std::string& bus_stop : request.stops) {
+        bus.stops.push_back(catalogue.GetStopByName(bus_stop));
+    }
+    bus.is_roundtrip = request.is_roundtrip;
+    return bus;
+}
+
+// Keys of this and the other answers below are written in alphabetical order,
+// the order json::Dict keeps them in
+void GetBusDictFromBusInfo(json::Writer& writer, const std::optional<BusInfo>& bus_info, int request_id) {
     if (bus_info) {
-        builder.StartDict()
+        writer.StartDict()
                     .Key("curvature"s).Value(bus_info.value().real_route_length / bus_info.value().route_length)
                     .Key("request_id"s).Value(request_id)
                     .Key("route_length"s).Value(bus_info.value().real_route_length)
@@ -54,113 +522,173 @@ void GetBusDictFromBusInfo(json::Builder& builder, const std::optional<BusInfo>&
                     .Key("unique_stop_count"s).Value( bus_info.value().unique_stop_number)
                 .EndDict();
     } else {
-        builder.StartDict()
-                    .Key("request_id"s).Value(request_id)
+        writer.StartDict()
                     .Key("error_message"s).Value("not found"s)
+                    .Key("request_id"s).Value(request_id)
                 .EndDict();
     }
 }
 
-void GetBusesDictFromBuses(json::Builder& builder, const std::optional<std::vector<std::string_view>>& buses, int request_id) {
+void GetBusesDictFromBuses(json::Writer& writer, const std::optional<std::vector<std::string_view>>& buses, int request_id) {
     if (buses) {
-        builder.StartDict();
-        builder.Key("buses"s);
-        builder.StartArray();
+        writer.StartDict();
+        writer.Key("buses"s);
+        writer.StartArray();
         for (const auto& bus_name : buses.value()) {
-            builder.Value(std::string(bus_name));
+            writer.Value(std::string(bus_name));
         }
-        builder.EndArray();
-        builder.Key("request_id"s).Value(request_id);
-        builder.EndDict();
+        writer.EndArray();
+        writer.Key("request_id"s).Value(request_id);
+        writer.EndDict();
     } else {
-        builder.StartDict()
-                    .Key("request_id"s).Value(request_id)
+        writer.StartDict()
                     .Key("error_message"s).Value("not found"s)
+                    .Key("request_id"s).Value(request_id)
                 .EndDict();
     }
 }
 
-void GetMapAsDict(json::Builder& builder, request_handler::RequestHandler& request_handler, int request_id) {
-    std::ostringstream out;
-    svg::Document doc =  request_handler.RenderMap();
-    doc.Render(out);
-    builder.StartDict()
-                .Key("map"s).Value(out.str())
+void GetMapAsDict(json::Writer& writer, request_handler::RequestHandler& request_handler, int request_id) {
+    writer.StartDict()
+                .Key("map"s).StreamValue([&request_handler](std::ostream& out) {
+                    request_handler.RenderMap(out);
+                })
                 .Key("request_id"s).Value(request_id)
             .EndDict();
-    
 }
-void InsertItemToResponse(json::Builder& builder,const TransportRouter::Item& item) {
+
+void GetMapAreaAsDict(json::Writer& writer, request_handler::RequestHandler& request_handler, const renderer::MapArea& area, int request_id) {
+    if (!renderer::IsValidMapArea(area)) {
+        writer.StartDict()
+                    .Key("error_message"s).Value("not found"s)
+                    .Key("request_id"s).Value(request_id)
+                .EndDict();
+        return;
+    }
+    writer.StartDict()
+                .Key("map"s).StreamValue([&request_handler, &area](std::ostream& out) {
+                    request_handler.RenderMapArea(area, out);
+                })
+                .Key("request_id"s).Value(request_id)
+            .EndDict();
+}
+
+void InsertItemToResponse(json::Writer& writer,const TransportRouter::Item& item) {
     if (item.type == TransportRouter::ItemType::WAIT) {
-        builder.StartDict()
-                .Key("type").Value("Wait"s)
+        writer.StartDict()
                 .Key("stop_name").Value(std::string(item.name))
                 .Key("time").Value(item.time)
+                .Key("type").Value("Wait"s)
             .EndDict();
     } else if (item.type == TransportRouter::ItemType::BUS) {
-        builder.StartDict()
-                .Key("type").Value("Bus"s)
+        writer.StartDict()
                 .Key("bus").Value(std::string(item.name))
                 .Key("span_count").Value(item.span_count)
                 .Key("time").Value(item.time)
+                .Key("type").Value("Bus"s)
             .EndDict();
     }
 }
-void GetItemMapFromItems(json::Builder& builder, const std::optional<TransportRouter::RouteItems>& items, int request_id) {
+void GetItemMapFromItems(json::Writer& writer, const std::optional<TransportRouter::RouteItems>& items, int request_id,
+                         const request_handler::RequestHandler* overlay_handler = nullptr) {
     if (items) {
-        builder.StartDict()
-            .Key("request_id").Value(request_id)
-            .Key("total_time").Value(items.value().total_time)
+        writer.StartDict()
             .Key("items")
             .StartArray();
         for (const auto& item : items.value().items) {
-            InsertItemToResponse(builder, item);
+            InsertItemToResponse(writer, item);
+        }
+        writer.EndArray();
+        if (overlay_handler) {
+            writer.Key("overlay"s).StreamValue([overlay_handler, &items](std::ostream& out) {
+                overlay_handler->RenderRouteOverlay(*items, out);
+            });
         }
-        builder.EndArray();
-        builder.EndDict();
+        writer.Key("request_id").Value(request_id)
+            .Key("total_time").Value(items.value().total_time);
+        writer.EndDict();
     } else {
-        builder.StartDict()
-                    .Key("request_id"s).Value(request_id)
+        writer.StartDict()
                     .Key("error_message"s).Value("not found"s)
+                    .Key("request_id"s).Value(request_id)
                 .EndDict();
     }
 }
 
-void StatRequestProcess(const json::Node& request_body, std::ostream& output, request_handler::RequestHandler& request_handler) {
-    json::Builder builder;
-    builder.StartArray();
-    for (const auto& stat_request : request_body.AsArray()) {
-        json::Dict request = stat_request.AsDict();
-        if (request["type"].AsString() == "Bus"s) {
-            GetBusDictFromBusInfo(builder, request_handler.GetBusInfo(request["name"].AsString()),  request["id"s].AsInt());
-        } else if (request["type"s].AsString() == "Stop"s) {
-            GetBusesDictFromBuses(builder, request_handler.GetBusesByStop(request["name"].AsString()),  request["id"s].AsInt());
-        } else if (request["type"s].AsString() == "Map"s) {
-            GetMapAsDict(builder, request_handler, request["id"s].AsInt());
-        } else if (request["type"s].AsString() == "Route"s) {
-            GetItemMapFromItems(builder, request_handler.GetRouteByStops(request["from"].AsString(), request["to"].AsString()), request["id"s].AsInt());
-        }
-    }
-    builder.EndArray();
-    json::Print(json::Document{builder.Build()}, output);
+struct StatRequestPrinter {
+    json::Writer& writer;
+    request_handler::RequestHandler& request_handler;
+
+    void operator()(const BusStatRequest& request) const {
+        GetBusDictFromBusInfo(writer, request_handler.GetBusInfo(request.name), request.id);
+    }
+    void operator()(const StopStatRequest& request) const {
+        GetBusesDictFromBuses(writer, request_handler.GetBusesByStop(request.name), request.id);
+    }
+    void operator()(const MapRequest& request) const {
+        GetMapAsDict(writer, request_handler, request.id);
+    }
+    void operator()(const MapTileRequest& request) const {
+        GetMapAreaAsDict(writer, request_handler, request.area, request.id);
+    }
+    void operator()(const RouteRequest& request) const {
+        GetItemMapFromItems(writer, request_handler.GetRouteByStops(request.from, request.to), request.id,
+                            request.overlay ? &request_handler : nullptr);
+    }
+};
+
+void StatRequestProcess(json::Writer& writer, const StatRequest& request, request_handler::RequestHandler& request_handler) {
+    std::visit(StatRequestPrinter{writer, request_handler}, request);
 }
 
-void BaseRequestProcess(TransportCatalogue& catalogue, const json::Node& request_body) {
-    Requests requests;
-    for (const auto& domain_request : request_body.AsArray()) {
-        json::Dict request = domain_request.AsDict();
-        if (request["type"].AsString() == "Bus"s) {
-            requests.buses.push_back(move(request));
-        } else if (request["type"].AsString() == "Stop"s) {
-            catalogue.AddStop(GetStopFromDict(request));
-            requests.stops.push_back(move(request));
-        }
+renderer::MapArea MakeMapArea(const RawRequest& request) {
+    if (request.zoom) {
+        renderer::MapTile tile = request.tile;
+        tile.zoom = *request.zoom;
+        return tile;
     }
+    if (request.bbox.size() != 4) {
+        throw std::logic_error("MapTile needs zoom, x and y or a bbox of four numbers"s);
+    }
+    return renderer::MapBox{{request.bbox[0], request.bbox[1]}, {request.bbox[2], request.bbox[3]}};
+}
+
+std::optional<StatRequest> MakeStatRequest(RawRequest request) {
+    switch (request.type) {
+        case RequestType::BUS:
+            return BusStatRequest{request.id, std::move(request.name)};
+        case RequestType::STOP:
+            return StopStatRequest{request.id, std::move(request.name)};
+        case RequestType::ROUTE:
+            return RouteRequest{request.id, std::move(request.from), std::move(request.to), request.overlay};
+        case RequestType::MAP:
+            return MapRequest{request.id};
+        case RequestType::MAP_TILE:
+            return MapTileRequest{request.id, MakeMapArea(request)};
+        default:
+            return std::nullopt;
+    }
+}
+
+void AddBaseRequest(Requests& requests, RawRequest request) {
+    if (request.type == RequestType::BUS) {
+        requests.buses.push_back({std::move(request.name), std::move(request.stops), request.is_roundtrip});
+    } else if (request.type == RequestType::STOP) {
+        requests.stops.push_back({std::move(request.name), request.coordinates, std::move(request.road_distances)});
+    }
+}
+
+// Distances and buses need all stops to be known. Stops and buses that are
+// already in the catalogue (loaded from a parent base) are updated
+void BaseRequestProcess(TransportCatalogue& catalogue, const Requests& requests) {
     for(const auto& add_stop_request : requests.stops) {
-        SetRealDistanceForStopFromRequest(catalogue, add_stop_request.AsDict());
+        catalogue.AddOrUpdateStop({add_stop_request.name, add_stop_request.coordinates});
+    }
+    for(const auto& add_stop_request : requests.stops) {
+        SetRealDistanceForStopFromRequest(catalogue, add_stop_request);
     }
     for(const auto& add_bus_request : requests.buses) {
-        catalogue.AddBus(GetBusFromDict(catalogue, add_bus_request.AsDict()));
+        catalogue.AddOrUpdateBus(GetBusFromRequest(catalogue, add_bus_request));
     }
 }
 
@@ -201,6 +729,27 @@ void SetRenderSettings(renderer::MapRenderer& renderer, const json::Node& reques
         setting_dict.at("underlayer_width").AsDouble(),
         color_palette
     };
+    if (const auto it = setting_dict.find("simplify_tolerance"s); it != setting_dict.end()) {
+        render_settings.simplify_tolerance = it->second.AsDouble();
+    }
+    if (const auto it = setting_dict.find("compact_svg"s); it != setting_dict.end()) {
+        render_settings.compact_svg = it->second.AsBool();
+    }
+    if (const auto it = setting_dict.find("coordinate_precision"s); it != setting_dict.end()) {
+        const int precision = it->second.AsInt();
+        if (precision < 0 || precision > renderer::MAX_COORDINATE_PRECISION) {
+            throw std::logic_error("Bad coordinate_precision "s + std::to_string(precision));
+        }
+        render_settings.coordinate_precision = precision;
+    }
+    // the number of threads isn't a part of the map, so it isn't stored in the base
+    if (const auto it = setting_dict.find("render_threads"s); it != setting_dict.end()) {
+        const int threads = it->second.AsInt();
+        if (threads < 1) {
+            throw std::logic_error("Bad render_threads "s + std::to_string(threads));
+        }
+        renderer.SetRenderThreads(static_cast<unsigned>(threads));
+    }
     renderer.SetSettings(render_settings);
 }
 
@@ -210,9 +759,39 @@ void SetRoutingSettings(TransportRouter& router, const json::Node& request_body)
                                        setting_dict.at("bus_velocity").AsDouble()});
 }
 
+// checksum is written as hex digits
+uint32_t ParseChecksum(std::string_view text) {
+    uint32_t checksum = 0;
+    const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), checksum, 16);
+    if (error != std::errc() || end != text.data() + text.size() || text.empty()) {
+        throw std::logic_error("Invalid base_checksum: "s + std::string(text));
+    }
+    return checksum;
+}
+
 void SetSerializationSettings(Serializer& serialiser, const json::Node& request_body) {
-    json::Dict setting_dict = request_body.AsDict();
-    serialiser.SetSettings(setting_dict.at("file").AsString());
+    const json::Dict& setting_dict = request_body.AsDict();
+    Serializer::Format format = Serializer::Format::PROTOBUF;
+    if (const auto it = setting_dict.find("format"); it != setting_dict.end()) {
+        const std::string& format_name = it->second.AsString();
+        if (format_name == "compact") {
+            format = Serializer::Format::COMPACT;
+        } else if (format_name == "stream") {
+            format = Serializer::Format::STREAM;
+        } else if (format_name == "flat") {
+            format = Serializer::Format::FLAT;
+        } else if (format_name != "protobuf") {
+            throw std::logic_error("Unknown base format: "s + format_name);
+        }
+    }
+    serialiser.SetSettings(setting_dict.at("file").AsString(), format);
+    if (const auto it = setting_dict.find("base"); it != setting_dict.end()) {
+        std::optional<uint32_t> checksum;
+        if (const auto checksum_it = setting_dict.find("base_checksum"); checksum_it != setting_dict.end()) {
+            checksum = ParseChecksum(checksum_it->second.AsString());
+        }
+        serialiser.SetParentBase(it->second.AsString(), checksum);
+    }
 }
 
 void RequestProcess(TransportCatalogue& catalogue,
@@ -221,18 +800,52 @@ void RequestProcess(TransportCatalogue& catalogue,
                     renderer::MapRenderer& renderer,
                     TransportRouter& router,
                     request_handler::RequestHandler& request_handler) {
-    json::Document requests = json::Load(input);
-    for (const auto& [request_type, request_body] : requests.GetRoot().AsDict()) {
-        if (request_type == "base_requests"s) {
-            BaseRequestProcess(catalogue, request_body);
-        } else if (request_type == "stat_requests"s) {
-            router.BuildAllRoutes();
-            StatRequestProcess(request_body, output, request_handler);
-        } else if (request_type == "render_settings"s){
-            SetRenderSettings(renderer, request_body);
-        } else if (request_type == "routing_settings"s){
-            SetRoutingSettings(router, request_body);
+    Requests requests;
+    std::vector<StatRequest> stat_requests;
+    std::optional<json::Node> render_settings;
+    std::optional<json::Node> routing_settings;
+    RequestDecoder base_requests([&requests](RawRequest request) {
+        AddBaseRequest(requests, std::move(request));
+    });
+    RequestDecoder stat_request([&stat_requests](RawRequest request) {
+        if (auto stat_request = MakeStatRequest(std::move(request))) {
+            stat_requests.push_back(std::move(*stat_request));
         }
+    });
+    NodeCollector render([&render_settings](json::Node body) {
+        render_settings = std::move(body);
+    });
+    NodeCollector routing([&routing_settings](json::Node body) {
+        routing_settings = std::move(body);
+    });
+    ArrayItems base_items(base_requests);
+    bool has_stat_requests = false;
+    ArrayItems stat_items(stat_request, [&has_stat_requests] {
+        has_stat_requests = true;
+    });
+    SectionDispatcher dispatcher;
+    dispatcher.On("base_requests"s, base_items);
+    dispatcher.On("stat_requests"s, stat_items);
+    dispatcher.On("render_settings"s, render);
+    dispatcher.On("routing_settings"s, routing);
+    json::Parse(input, dispatcher);
+
+    // stat requests may precede settings in the document, so they are answered last
+    BaseRequestProcess(catalogue, requests);
+    if (render_settings) {
+        SetRenderSettings(renderer, *render_settings);
+    }
+    if (routing_settings) {
+        SetRoutingSettings(router, *routing_settings);
+    }
+    if (has_stat_requests) {
+        router.BuildAllRoutes();
+        json::Writer writer(output);
+        writer.StartArray();
+        for (const auto& request : stat_requests) {
+            StatRequestProcess(writer, request, request_handler);
+        }
+        writer.EndArray();
     }
 }
 
@@ -240,37 +853,221 @@ void MakeBaseRequestProcess(TransportCatalogue& catalogue,
                             std::istream& input,
                             renderer::MapRenderer& renderer,
                             TransportRouter& router,
-                            Serializer& serialiser) {
-    json::Document requests = json::Load(input);
-    for (const auto& [request_type, request_body] : requests.GetRoot().AsDict()) {
-        if (request_type == "base_requests"s) {
-            BaseRequestProcess(catalogue, request_body);
-        } else if (request_type == "render_settings"s){
-            SetRenderSettings(renderer, request_body);
-        } else if (request_type == "routing_settings"s){
-            SetRoutingSettings(router, request_body);
-        } else if (request_type == "serialization_settings"s){
-            SetSerializationSettings(serialiser, request_body);
-        }
+                            Serializer& serialiser,
+                            unsigned parse_threads) {
+    Requests requests;
+    std::optional<json::Node> render_settings;
+    std::optional<json::Node> routing_settings;
+    auto add_base_request = [&requests](RawRequest request) {
+        AddBaseRequest(requests, std::move(request));
+    };
+    // parsing from memory is several times faster than from the stream, the parallel decoder
+    // also gets its items as views of this text
+    const std::string text = ReadAll(input);
+    json::MemoryStreambuf buf(text);
+    std::istream memory_input(&buf);
+    RequestDecoder base_requests(add_base_request);
+    ParallelRequestDecoder parallel_base_requests(parse_threads, text, add_base_request);
+    NodeCollector render([&render_settings](json::Node body) {
+        render_settings = std::move(body);
+    });
+    NodeCollector routing([&routing_settings](json::Node body) {
+        routing_settings = std::move(body);
+    });
+    NodeCollector serialization([&serialiser](json::Node body) {
+        SetSerializationSettings(serialiser, body);
+    });
+    ArrayItems base_items(base_requests);
+    SectionDispatcher dispatcher;
+    if (parse_threads > 1) {
+        dispatcher.On("base_requests"s, parallel_base_requests);
+    } else {
+        dispatcher.On("base_requests"s, base_items);
     }
+    dispatcher.On("render_settings"s, render);
+    dispatcher.On("routing_settings"s, routing);
+    dispatcher.On("serialization_settings"s, serialization);
+    json::Parse(memory_input, dispatcher);
+
+    // a delta document is applied on top of its parent base, settings it has replace the parent ones
+    serialiser.LoadParentBase();
+    if (render_settings) {
+        SetRenderSettings(renderer, *render_settings);
+    }
+    if (routing_settings) {
+        SetRoutingSettings(router, *routing_settings);
+    }
+    BaseRequestProcess(catalogue, requests);
     serialiser.SerializeBaseToFile();
 }
 
-void FromDbRequestProcess(TransportCatalogue& catalogue,
-                    std::istream& input,
+// Loads the parts of the base a request needs when the first such request comes:
+// distances for Bus and Route, settings for Map, MapTile and Route, routes for Route
+class BaseLoader {
+public:
+    BaseLoader(Serializer& serialiser, TransportRouter& router) : serialiser_(serialiser), router_(router) {
+    }
+
+    void Prepare(const StatRequest& request) {
+        if (!base_opened_) {
+            serialiser_.OpenBase();
+            base_opened_ = true;
+        }
+        std::visit(*this, request);
+    }
+
+    void operator()(const StopStatRequest&) {
+    }
+    void operator()(const BusStatRequest&) {
+        serialiser_.LoadDistances();
+    }
+    void operator()(const MapRequest&) {
+        serialiser_.LoadSettings();
+    }
+    void operator()(const MapTileRequest&) {
+        serialiser_.LoadSettings();
+    }
+    void operator()(const RouteRequest&) {
+        if (!routes_built_) {
+            serialiser_.LoadDistances();
+            serialiser_.LoadSettings();
+            router_.BuildAllRoutes();
+            routes_built_ = true;
+        }
+    }
+
+private:
+    Serializer& serialiser_;
+    TransportRouter& router_;
+    bool base_opened_ = false;
+    bool routes_built_ = false;
+};
+
+void FromDbRequestProcess(std::istream& input,
                     std::ostream& output,
                     request_handler::RequestHandler& request_handler,
                     TransportRouter& router,
                     Serializer& serialiser) {
-    json::Document requests = json::Load(input);
-    for (const auto& [request_type, request_body] : requests.GetRoot().AsDict()) {
-        if (request_type == "stat_requests"s) {
-            serialiser.DeserializeBaseFromFile();
-            router.BuildAllRoutes();
-            StatRequestProcess(request_body, output, request_handler);
-        } else if (request_type == "serialization_settings"s){
-            SetSerializationSettings(serialiser, request_body);
+    bool has_settings = false;
+    BaseLoader base_loader(serialiser, router);
+
+    json::Writer writer(output);
+    // requests met before serialization_settings wait for the base file name
+    std::vector<StatRequest> pending_requests;
+    RequestDecoder stat_request([&](RawRequest raw_request) {
+        auto request = MakeStatRequest(std::move(raw_request));
+        if (!request) {
+            return;
+        }
+        if (!has_settings) {
+            pending_requests.push_back(std::move(*request));
+            return;
+        }
+        base_loader.Prepare(*request);
+        StatRequestProcess(writer, *request, request_handler);
+    });
+    NodeCollector serialization([&](json::Node body) {
+        SetSerializationSettings(serialiser, body);
+        has_settings = true;
+    });
+    bool has_stat_requests = false;
+    ArrayItems stat_items(stat_request, [&] {
+        has_stat_requests = true;
+        writer.StartArray();
+    });
+    SectionDispatcher dispatcher;
+    dispatcher.On("stat_requests"s, stat_items);
+    dispatcher.On("serialization_settings"s, serialization);
+    json::Parse(input, dispatcher);
+
+    if (!has_stat_requests) {
+        return;
+    }
+    for (const auto& request : pending_requests) {
+        base_loader.Prepare(request);
+        StatRequestProcess(writer, request, request_handler);
+    }
+    writer.EndArray();
+}
+
+// request_id is null when the line is too broken to find it
+void WriteErrorLine(std::ostream& output, std::optional<int> request_id, std::string message) {
+    json::Writer writer(output, true);
+    writer.StartDict().Key("error_message"s).Value(std::move(message));
+    if (request_id) {
+        writer.Key("request_id"s).Value(*request_id);
+    } else {
+        writer.Key("request_id"s).Value(nullptr);
+    }
+    writer.EndDict();
+}
+
+void JsonLinesRequestProcess(std::istream& input,
+                             std::ostream& output,
+                             request_handler::RequestHandler& request_handler,
+                             TransportRouter& router,
+                             Serializer& serialiser) {
+    bool has_settings = false;
+    BaseLoader base_loader(serialiser, router);
+
+    // every non-empty line gets one answer line: a bad line is answered with an error
+    // carrying its id and the stream goes on. Handlers are made per line, since a failed
+    // parse leaves them in the middle of a value
+    std::string line;
+    while (std::getline(input, line)) {
+        if (line.find_first_not_of(" \t\r"sv) == std::string::npos) {
+            continue;
+        }
+        std::istringstream line_input(line);
+        // the first line carries serialization_settings, every other one is a stat request
+        if (!has_settings) {
+            std::optional<int> request_id;
+            NodeCollector serialization([&](json::Node body) {
+                SetSerializationSettings(serialiser, body);
+                has_settings = true;
+            });
+            NodeCollector id([&request_id](json::Node id) {
+                if (id.IsInt()) {
+                    request_id = id.AsInt();
+                }
+            });
+            SectionDispatcher settings_dispatcher;
+            settings_dispatcher.On("serialization_settings"s, serialization);
+            settings_dispatcher.On("id"s, id);
+            try {
+                json::Parse(line_input, settings_dispatcher);
+                if (has_settings) {
+                    continue;
+                }
+                WriteErrorLine(output, request_id, "serialization_settings expected"s);
+            } catch (const std::exception& e) {
+                WriteErrorLine(output, request_id, e.what());
+            }
+        } else {
+            std::optional<StatRequest> request;
+            RequestDecoder stat_request([&request](RawRequest raw_request) {
+                request = MakeStatRequest(std::move(raw_request));
+                if (!request) {
+                    throw std::logic_error("Unknown request type"s);
+                }
+            });
+            try {
+                json::Parse(line_input, stat_request);
+                if (!request) {
+                    throw std::logic_error("Request is missing"s);
+                }
+                base_loader.Prepare(*request);
+            } catch (const std::exception& e) {
+                request.reset();
+                WriteErrorLine(output, stat_request.GetId(), e.what());
+            }
+            if (request) {
+                json::Writer writer(output, true);
+                StatRequestProcess(writer, *request, request_handler);
+            }
         }
+        output.put('\n');
+        output.flush();
     }
 }
 
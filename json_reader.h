@@ -1,6 +1,10 @@
 #pragma once
 
 #include <iostream>
+#include <string>
+#include <utility>
+#include <variant>
+#include <vector>
 
 #include "json.h"
 #include "transport_catalogue.h"
@@ -14,14 +18,64 @@
 namespace transport_catalogue {
 namespace json_reader{
 
+struct StopRequest {
+    std::string name;
+    detail::Coordinates coordinates;
+    std::vector<std::pair<std::string, int>> road_distances;
+};
+
+struct BusRequest {
+    std::string name;
+    std::vector<std::string> stops;
+    bool is_roundtrip;
+};
+
 struct Requests {
-    std::vector<json::Node> buses;
-    std::vector<json::Node> stops;
+    std::vector<BusRequest> buses;
+    std::vector<StopRequest> stops;
+};
+
+struct BusStatRequest {
+    int id;
+    std::string name;
+};
+
+struct StopStatRequest {
+    int id;
+    std::string name;
 };
 
+struct RouteRequest {
+    int id;
+    std::string from;
+    std::string to;
+    // the answer also carries an SVG overlay of the route
+    bool overlay = false;
+};
+
+struct MapRequest {
+    int id;
+};
+
+// either a z/x/y tile or a bbox in the coordinates of the whole map
+struct MapTileRequest {
+    int id;
+    renderer::MapArea area;
+};
+
+using StatRequest = std::variant<BusStatRequest, StopStatRequest, RouteRequest, MapRequest, MapTileRequest>;
+
 void RequestProcess(TransportCatalogue& catalogue, std::istream& input, std::ostream& output, renderer::MapRenderer& renderer, TransportRouter& router, request_handler::RequestHandler& request_handler);
-void MakeBaseRequestProcess(TransportCatalogue& catalogue, std::istream& input, renderer::MapRenderer& renderer, TransportRouter& router, Serializer& serialiser);
-void FromDbRequestProcess(TransportCatalogue& catalogue, std::istream& input, std::ostream& output, request_handler::RequestHandler& request_handler, TransportRouter& router, Serializer& serialiser);
+// The input is read into memory at once. With parse_threads > 1 base_requests are decoded
+// in chunks on several threads, the catalogue is filled in the same order as by the
+// single-threaded pass. Item boundaries are found by one scan of the buffer on the calling thread
+void MakeBaseRequestProcess(TransportCatalogue& catalogue, std::istream& input, renderer::MapRenderer& renderer, TransportRouter& router, Serializer& serialiser,
+                            unsigned parse_threads = 1);
+void FromDbRequestProcess(std::istream& input, std::ostream& output, request_handler::RequestHandler& request_handler, TransportRouter& router, Serializer& serialiser);
+// Newline-delimited mode: the first line is {"serialization_settings": {...}},
+// every next line is a single stat request answered by one compact line.
+// A line that fails is answered with an error_message and the stream goes on
+void JsonLinesRequestProcess(std::istream& input, std::ostream& output, request_handler::RequestHandler& request_handler, TransportRouter& router, Serializer& serialiser);
 
 }
 }
@@ -0,0 +1,198 @@
+#include "json_writer.h"
+
+#include <string>
+
+namespace json {
+
+using namespace std::literals;
+
+namespace {
+
+const int INDENT_STEP = 4;
+
+}
+
+Writer::Writer(std::ostream& output, bool compact) : output_(output), compact_(compact) {
+}
+
+Writer::Level& Writer::GetCurrentLevel() {
+    if (levels_.empty()) {
+        throw std::logic_error("stack empty"s);
+    }
+    return levels_.back();
+}
+
+void Writer::NewLineWithIndent() {
+    if (compact_) {
+        return;
+    }
+    output_.put('\n');
+    for (size_t i = 0; i < levels_.size() * INDENT_STEP; ++i) {
+        output_.put(' ');
+    }
+}
+
+void Writer::StartItem() {
+    Level& level = GetCurrentLevel();
+    if (!level.is_empty) {
+        output_.put(',');
+    }
+    level.is_empty = false;
+    NewLineWithIndent();
+}
+
+void Writer::CloseLevel() {
+    // строка переводится после открывающей скобки и у пустого контейнера
+    if (levels_.back().is_empty && !compact_) {
+        output_.put('\n');
+    }
+    levels_.pop_back();
+    NewLineWithIndent();
+}
+
+void Writer::StartValue() {
+    if (has_key_) {
+        has_key_ = false;
+    } else if (levels_.empty()) {
+        return;
+    } else if (GetCurrentLevel().is_dict) {
+        throw std::logic_error("Insert Value not for the key"s);
+    } else {
+        StartItem();
+    }
+}
+
+Writer::KeyContext Writer::Key(std::string_view key) {
+    if (has_key_ || !GetCurrentLevel().is_dict) {
+        throw std::logic_error("Key() called not in context"s);
+    }
+    StartItem();
+    PrintString(key, output_);
+    output_ << (compact_ ? ":"sv : ": "sv);
+    has_key_ = true;
+    return {*this};
+}
+
+void Writer::WriteNode(const Node& node) {
+    if (node.IsArray()) {
+        StartArray();
+        for (const Node& item : node.AsArray()) {
+            WriteNode(item);
+        }
+        EndArray();
+    } else if (node.IsDict()) {
+        StartDict();
+        for (const auto& [key, item] : node.AsDict()) {
+            Key(key);
+            WriteNode(item);
+        }
+        EndDict();
+    } else {
+        StartValue();
+        if (node.IsString()) {
+            PrintString(node.AsString(), output_);
+        } else if (node.IsNull()) {
+            output_ << "null"sv;
+        } else if (node.IsBool()) {
+            output_ << (node.AsBool() ? "true"sv : "false"sv);
+        } else if (node.IsInt()) {
+            PrintNumber(node.AsInt(), output_);
+        } else {
+            PrintNumber(node.AsDouble(), output_);
+        }
+    }
+}
+
+Writer& Writer::Value(Node::Value value) {
+    WriteNode(Node(std::move(value)));
+    return *this;
+}
+
+Writer& Writer::StreamValue(const std::function<void(std::ostream&)>& write) {
+    StartValue();
+    output_.put('"');
+    EscapingStreambuf escaping_buf(output_);
+    std::ostream escaped(&escaping_buf);
+    write(escaped);
+    output_.put('"');
+    return *this;
+}
+
+Writer::DictItemContext Writer::StartDict() {
+    StartValue();
+    output_.put('{');
+    levels_.push_back({true});
+    return {*this};
+}
+
+Writer::ArrayContext Writer::StartArray() {
+    StartValue();
+    output_.put('[');
+    levels_.push_back({false});
+    return {*this};
+}
+
+Writer& Writer::EndDict() {
+    if (has_key_ || !GetCurrentLevel().is_dict) {
+        throw std::logic_error("EndDict() called not in context"s);
+    }
+    CloseLevel();
+    output_.put('}');
+    return *this;
+}
+
+Writer& Writer::EndArray() {
+    if (GetCurrentLevel().is_dict) {
+        throw std::logic_error("EndArray() called not in context"s);
+    }
+    CloseLevel();
+    output_.put(']');
+    return *this;
+}
+
+Writer::DictItemContext Writer::Context::StartDict() {
+    writer_.StartDict();
+    return {writer_};
+}
+
+Writer::ArrayContext Writer::Context::StartArray() {
+    writer_.StartArray();
+    return {writer_};
+}
+
+Writer& Writer::Context::EndDict() {
+    writer_.EndDict();
+    return writer_;
+}
+
+Writer& Writer::Context::EndArray() {
+    writer_.EndArray();
+    return writer_;
+}
+
+Writer::KeyContext Writer::Context::Key(std::string_view key) {
+    writer_.Key(key);
+    return {writer_};
+}
+
+Writer::DictItemContext Writer::KeyContext::Value(Node::Value value) {
+    writer_.Value(std::move(value));
+    return {writer_};
+}
+
+Writer::DictItemContext Writer::KeyContext::StreamValue(const std::function<void(std::ostream&)>& write) {
+    writer_.StreamValue(write);
+    return {writer_};
+}
+
+Writer::ArrayContext Writer::ArrayContext::StreamValue(const std::function<void(std::ostream&)>& write) {
+    writer_.StreamValue(write);
+    return {writer_};
+}
+
+Writer::ArrayContext Writer::ArrayContext::Value(Node::Value value) {
+    writer_.Value(std::move(value));
+    return {writer_};
+}
+
+}
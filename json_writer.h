@@ -0,0 +1,90 @@
+#pragma once
+
+#include <functional>
+#include <iostream>
+#include <string_view>
+#include <vector>
+
+#include "json.h"
+
+namespace json {
+
+// Пишет JSON прямо в поток по мере вызовов, не собирая дерево Node.
+// Интерфейс повторяет json::Builder. По умолчанию выводит с отступом в 4 пробела, каждое значение с новой строки
+class Writer {
+
+    class DictItemContext;
+    class ArrayContext;
+    class KeyContext;
+
+    class Context {
+    public:
+        Context(Writer& writer) : writer_(writer) {}
+        DictItemContext StartDict();
+        ArrayContext StartArray();
+        Writer& EndDict();
+        Writer& EndArray();
+        KeyContext Key(std::string_view key);
+    protected:
+        Writer& writer_;
+    };
+
+    class KeyContext : public Context {
+    public:
+        DictItemContext Value(Node::Value value);
+        DictItemContext StreamValue(const std::function<void(std::ostream&)>& write);
+        Writer& EndDict() = delete;
+        Writer& EndArray() = delete;
+        KeyContext Key(std::string_view key) = delete;
+    };
+
+    class DictItemContext : public Context {
+    public:
+        DictItemContext StartDict() = delete;
+        ArrayContext StartArray() = delete;
+        Writer& EndArray() = delete;
+    };
+
+    class ArrayContext : public Context {
+    public:
+        ArrayContext Value(Node::Value value);
+        ArrayContext StreamValue(const std::function<void(std::ostream&)>& write);
+        Writer& EndDict() = delete;
+        KeyContext Key(std::string_view key) = delete;
+    };
+
+public:
+
+    // compact - без переводов строк и отступов
+    explicit Writer(std::ostream& output, bool compact = false);
+    DictItemContext StartDict();
+    ArrayContext StartArray();
+    KeyContext Key(std::string_view key);
+    Writer& Value(Node::Value value);
+    // Пишет строковое значение, текст которого write выводит в переданный ему поток.
+    // Текст экранируется на лету, без промежуточной строки
+    Writer& StreamValue(const std::function<void(std::ostream&)>& write);
+    Writer& EndDict();
+    Writer& EndArray();
+
+private:
+
+    struct Level {
+        bool is_dict;
+        bool is_empty = true;
+    };
+
+    void StartValue();
+    void StartItem();
+    void CloseLevel();
+    void NewLineWithIndent();
+    void WriteNode(const Node& node);
+    Level& GetCurrentLevel();
+
+    std::ostream& output_;
+    bool compact_;
+    bool has_key_ = false;
+    std::vector<Level> levels_;
+};
+
+}
@@ -1,6 +1,8 @@
 
+#include <charconv>
 #include <fstream>
 #include <iostream>
+#include <optional>
 #include <tuple>
 #include <vector>
 
@@ -15,42 +17,74 @@
 using namespace std;
 
 void PrintUsage(std::ostream& stream = std::cerr) {
-    stream << "Usage: transport_catalogue [make_base|process_requests]\n"sv;
+    stream << "Usage: transport_catalogue [make_base [--parse-threads=N]|process_requests [--jsonl]]\n"sv;
 }
 
-void MakeBaseProcess() {
+// Reads N of --parse-threads=N, N must be positive
+std::optional<unsigned> ParseThreadsOption(std::string_view option) {
+    constexpr std::string_view prefix = "--parse-threads="sv;
+    if (option.substr(0, prefix.size()) != prefix) {
+        return std::nullopt;
+    }
+    option.remove_prefix(prefix.size());
+    unsigned threads = 0;
+    const auto [end, ec] = std::from_chars(option.data(), option.data() + option.size(), threads);
+    if (ec != std::errc{} || end != option.data() + option.size() || threads == 0) {
+        return std::nullopt;
+    }
+    return threads;
+}
+
+void MakeBaseProcess(unsigned parse_threads) {
     using namespace transport_catalogue;
     TransportCatalogue catalogue;
     renderer::MapRenderer renderer;
     TransportRouter router(catalogue);
     Serializer serialiser(catalogue, renderer, router);
-    json_reader::MakeBaseRequestProcess(catalogue, cin, renderer, router, serialiser);
+    json_reader::MakeBaseRequestProcess(catalogue, cin, renderer, router, serialiser, parse_threads);
 }
 
-void ProcessRequestProcess() {
+void ProcessRequestProcess(bool json_lines) {
     using namespace transport_catalogue;
     TransportCatalogue catalogue;
     renderer::MapRenderer renderer;
     TransportRouter router(catalogue);
     request_handler::RequestHandler request_handler(catalogue, renderer, router);
     Serializer serialiser(catalogue, renderer, router);
-    json_reader::FromDbRequestProcess(catalogue, cin, cout, request_handler, router, serialiser);
+    if (json_lines) {
+        json_reader::JsonLinesRequestProcess(cin, cout, request_handler, router, serialiser);
+    } else {
+        json_reader::FromDbRequestProcess(cin, cout, request_handler, router, serialiser);
+    }
+#ifdef TRANSPORT_CATALOGUE_STATS
+    const auto cache_stats = renderer.GetCacheStats();
+    cerr << "render cache: "sv << cache_stats.hits << " hits, "sv << cache_stats.misses << " misses\n"sv;
+#endif
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
+    if (argc != 2 && argc != 3) {
         PrintUsage();
         return 1;
     }
 
     const std::string_view mode(argv[1]);
+    const std::string_view option(argc == 3 ? argv[2] : "");
 
-    if (mode == "make_base"sv) {
-        MakeBaseProcess();
-    } else if (mode == "process_requests"sv) {
-        ProcessRequestProcess();
-    } else {
-        PrintUsage();
+    // a broken input or base, e.g. a base_checksum mismatch, ends the run with a message instead of std::terminate
+    try {
+        if (mode == "make_base"sv && option.empty()) {
+            MakeBaseProcess(1);
+        } else if (const auto parse_threads = ParseThreadsOption(option); mode == "make_base"sv && parse_threads) {
+            MakeBaseProcess(*parse_threads);
+        } else if (mode == "process_requests"sv && (option.empty() || option == "--jsonl"sv)) {
+            ProcessRequestProcess(option == "--jsonl"sv);
+        } else {
+            PrintUsage();
+            return 1;
+        }
+    } catch (const std::exception& e) {
+        cerr << "Error: "sv << e.what() << '\n';
         return 1;
     }
 }
@@ -1,6 +1,16 @@
 #include "map_renderer.h"
 
-#include <set>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <future>
+#include <sstream>
+#include <unordered_map>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace transport_catalogue {
 namespace renderer {
@@ -10,148 +20,931 @@ bool IsZero(double value) {
     return std::abs(value) < 1e-6;
 }
 
-render_settings MapRenderer::GetSettings() {
+SphereProjector::SphereProjector(const double* lats, const double* lngs, size_t count, double max_width,
+                                 double max_height, double padding)
+    : padding_(padding) {
+    if (count == 0) {
+        return;
+    }
+    double min_lon = lngs[0];
+    double max_lon = lngs[0];
+    double min_lat = lats[0];
+    double max_lat = lats[0];
+    size_t i = 1;
+#ifdef __SSE2__
+    // two points a step in the lanes of SSE2 registers, the compiler keeps a plain
+    // min/max loop scalar. The lanes are reduced at the end, the tail goes to the loop below
+    if (count >= 2) {
+        __m128d min_lon2 = _mm_set1_pd(min_lon);
+        __m128d max_lon2 = _mm_set1_pd(max_lon);
+        __m128d min_lat2 = _mm_set1_pd(min_lat);
+        __m128d max_lat2 = _mm_set1_pd(max_lat);
+        for (i = 0; i + 2 <= count; i += 2) {
+            const __m128d lng = _mm_loadu_pd(lngs + i);
+            const __m128d lat = _mm_loadu_pd(lats + i);
+            // the lane of the second argument is kept on ties and NaN, as with std::min(acc, value)
+            min_lon2 = _mm_min_pd(lng, min_lon2);
+            max_lon2 = _mm_max_pd(lng, max_lon2);
+            min_lat2 = _mm_min_pd(lat, min_lat2);
+            max_lat2 = _mm_max_pd(lat, max_lat2);
+        }
+        const auto low = [](__m128d lanes) {
+            return _mm_cvtsd_f64(lanes);
+        };
+        const auto high = [](__m128d lanes) {
+            return _mm_cvtsd_f64(_mm_unpackhi_pd(lanes, lanes));
+        };
+        min_lon = std::min(low(min_lon2), high(min_lon2));
+        max_lon = std::max(low(max_lon2), high(max_lon2));
+        min_lat = std::min(low(min_lat2), high(min_lat2));
+        max_lat = std::max(low(max_lat2), high(max_lat2));
+    }
+#endif
+    for (; i < count; ++i) {
+        min_lon = std::min(min_lon, lngs[i]);
+        max_lon = std::max(max_lon, lngs[i]);
+        min_lat = std::min(min_lat, lats[i]);
+        max_lat = std::max(max_lat, lats[i]);
+    }
+    SetBounds(min_lon, max_lon, min_lat, max_lat, max_width, max_height);
+}
+
+void SphereProjector::operator()(const double* lats, const double* lngs, size_t count, svg::Point* points) const {
+    for (size_t i = 0; i < count; ++i) {
+        points[i].x = (lngs[i] - min_lon_) * zoom_coeff_ + padding_;
+        points[i].y = (max_lat_ - lats[i]) * zoom_coeff_ + padding_;
+    }
+}
+
+void SphereProjector::SetBounds(double min_lon, double max_lon, double min_lat, double max_lat, double max_width, double max_height) {
+    min_lon_ = min_lon;
+    max_lat_ = max_lat;
+
+    std::optional<double> width_zoom;
+    if (!IsZero(max_lon - min_lon)) {
+        width_zoom = (max_width - 2 * padding_) / (max_lon - min_lon);
+    }
+
+    std::optional<double> height_zoom;
+    if (!IsZero(max_lat - min_lat)) {
+        height_zoom = (max_height - 2 * padding_) / (max_lat - min_lat);
+    }
+
+    if (width_zoom && height_zoom) {
+        zoom_coeff_ = std::min(*width_zoom, *height_zoom);
+    } else if (width_zoom) {
+        zoom_coeff_ = *width_zoom;
+    } else if (height_zoom) {
+        zoom_coeff_ = *height_zoom;
+    }
+}
+
+render_settings MapRenderer::GetSettings() const {
     return render_settings_;
 }
 
-svg::Polyline MapRenderer::RenderBusRoute(const Bus* bus_ptr,  SphereProjector& projector, int color_number) const {
-    svg::Polyline route;
-    for (const auto& stop_ptr : bus_ptr->stops) {
-        route.AddPoint(projector(stop_ptr->coordinates));
-    }
-    if (!bus_ptr->is_roundtrip)  {
-        for(int i = static_cast<int>(bus_ptr->stops.size() - 2); i >= 0; --i) {
-            route.AddPoint(projector(bus_ptr->stops[i]->coordinates));
-        }
-    }
-    route.SetFillColor("none");
-    route.SetStrokeColor(render_settings_.color_palette[color_number % render_settings_.color_palette.size()]);
-    route.SetStrokeWidth(render_settings_.line_width);
-    route.SetStrokeLineCap(svg::StrokeLineCap::ROUND);
-    route.SetStrokeLineJoin(svg::StrokeLineJoin::ROUND);
-    return route;
-}
-
-svg::Text MapRenderer::RenderBusNameBase(const Bus* bus_ptr,  svg::Point position) const {
-    svg::Text route_name_base;
-    
-    route_name_base.SetPosition(position);
-    route_name_base.SetOffset(render_settings_.bus_label_offset);
-    route_name_base.SetFontSize(render_settings_.bus_label_font_size);
-    route_name_base.SetFontFamily("Verdana"s);
-    route_name_base.SetFontWeight("bold"s);
-    route_name_base.SetData(bus_ptr->name);
-    
-    route_name_base.SetFillColor(render_settings_.underlayer_color);
-    route_name_base.SetStrokeColor(render_settings_.underlayer_color);
-    route_name_base.SetStrokeWidth(render_settings_.underlayer_width);
-    route_name_base.SetStrokeLineCap(svg::StrokeLineCap::ROUND);
-    route_name_base.SetStrokeLineJoin(svg::StrokeLineJoin::ROUND);
-    
-    return route_name_base;
-}
-
-svg::Text MapRenderer::RenderBusName(const Bus* bus_ptr,  svg::Point position, int color_number) const {
-    svg::Text route_name;
-    
-    route_name.SetPosition(position);
-    route_name.SetOffset(render_settings_.bus_label_offset);
-    route_name.SetFontSize(render_settings_.bus_label_font_size);
-    route_name.SetFontFamily("Verdana"s);
-    route_name.SetFontWeight("bold"s);
-    route_name.SetData(bus_ptr->name);
-    
-    route_name.SetFillColor(render_settings_.color_palette[color_number % render_settings_.color_palette.size()]);
-    
-    return route_name;
-}
-
-svg::Circle MapRenderer::RenderStopSymbol(svg::Point position) const {
-    svg::Circle stop_symbol;
-    stop_symbol.SetCenter(position);
-    stop_symbol.SetRadius(render_settings_.stop_radius);
-    stop_symbol.SetFillColor("white"s);
-    return stop_symbol;
-}
-
-svg::Text MapRenderer::RenderStopNameBase(const Stop* stop_ptr, svg::Point position) const {
-    svg::Text stop_name_base;
-    stop_name_base.SetPosition(position);
-    stop_name_base.SetOffset(render_settings_.stop_label_offset);
-    stop_name_base.SetFontSize(render_settings_.stop_label_font_size);
-    stop_name_base.SetFontFamily("Verdana"s);
-    stop_name_base.SetData(stop_ptr->name);
-    
-    stop_name_base.SetFillColor(render_settings_.underlayer_color);
-    stop_name_base.SetStrokeColor(render_settings_.underlayer_color);
-    stop_name_base.SetStrokeWidth(render_settings_.underlayer_width);
-    stop_name_base.SetStrokeLineCap(svg::StrokeLineCap::ROUND);
-    stop_name_base.SetStrokeLineJoin(svg::StrokeLineJoin::ROUND);
-    
-    return stop_name_base;
-}
-
-svg::Text MapRenderer::RenderStopName(const Stop* stop_ptr, svg::Point position) const {
-    svg::Text stop_name;
-
-    stop_name.SetPosition(position);
-    stop_name.SetOffset(render_settings_.stop_label_offset);
-    stop_name.SetFontSize(render_settings_.stop_label_font_size);
-    stop_name.SetFontFamily("Verdana"s);
-    stop_name.SetData(stop_ptr->name);
-    
-    
-    stop_name.SetFillColor("black"s);
-    
-    return stop_name;
-}
-
-svg::Document MapRenderer::RenderBusRoutes(const std::map<std::string_view, const Bus*>& buses_dict) const {
-    svg::Document svg_doc;
-    auto comp = [] (const Stop* lhs, const Stop* rhs) {
-                                             return lhs->name < rhs->name;
-                     };
-    std::set<const Stop*, decltype(comp)> stop_ptr_arr(comp);
-    for (const auto& [bus_name, bus_ptr] : buses_dict) {
-        stop_ptr_arr.insert(bus_ptr->stops.begin(), bus_ptr->stops.end());
-    }
-    SphereProjector projector(stop_ptr_arr.begin(),
-                              stop_ptr_arr.end(),
-                              render_settings_.width,
-                              render_settings_.height,
-                              render_settings_.padding);
-    int route_count = 0;
+namespace {
+
+const svg::Color NO_FILL_COLOR = "none"s;
+const svg::Color STOP_SYMBOL_COLOR = "white"s;
+// routes and bus names of a base without render_settings, which has no palette
+const svg::Color DEFAULT_BUS_COLOR = "black"s;
+const svg::Color STOP_NAME_COLOR = "black"s;
+constexpr std::string_view FONT_FAMILY = "Verdana"sv;
+constexpr std::string_view BUS_NAME_FONT_WEIGHT = "bold"sv;
+constexpr std::string_view STOP_SYMBOL_ID = "s"sv;
+constexpr std::string_view UNDERLAYER_CLASS = "u"sv;
+constexpr std::string_view CLIP_ID = "c"sv;
+
+// the grid of a layout has about one stop per cell, but no more than this number of cells on a side
+constexpr size_t MAX_GRID_SIZE = 256;
+
+bool IsInBox(svg::Point point, const MapBox& box) {
+    return point.x >= box.min.x && point.x <= box.max.x && point.y >= box.min.y && point.y <= box.max.y;
+}
+
+// Liang-Barsky clipping of the segment by the box, a segment of a single point is a point.
+// If the segment crosses the box, its ends are moved to the ends of the part inside the box
+bool ClipSegment(svg::Point& from, svg::Point& to, const MapBox& box) {
+    const double dx = to.x - from.x;
+    const double dy = to.y - from.y;
+    const double p[4] = {-dx, dx, -dy, dy};
+    const double q[4] = {from.x - box.min.x, box.max.x - from.x, from.y - box.min.y, box.max.y - from.y};
+    double enter = 0;
+    double leave = 1;
+    for (int i = 0; i < 4; ++i) {
+        if (p[i] == 0) {
+            if (q[i] < 0) {
+                return false;
+            }
+            continue;
+        }
+        const double t = q[i] / p[i];
+        if (p[i] < 0) {
+            enter = std::max(enter, t);
+        } else {
+            leave = std::min(leave, t);
+        }
+        if (enter > leave) {
+            return false;
+        }
+    }
+    // the ends inside the box are kept as they are, so the runs of a route stay joined
+    if (leave < 1) {
+        to = {from.x + leave * dx, from.y + leave * dy};
+    }
+    if (enter > 0) {
+        from = {from.x + enter * dx, from.y + enter * dy};
+    }
+    return true;
+}
+
+bool IsSamePoint(svg::Point lhs, svg::Point rhs) {
+    return IsZero(lhs.x - rhs.x) && IsZero(lhs.y - rhs.y);
+}
+
+// Renders layers of items in chunks of RENDER_CHUNK_SIZE on a pool of up to threads workers,
+// which take chunks by a shared index. Every chunk goes to a buffer of its own, the buffers
+// are written to out in the order of layers and items, so the output is the same for any
+// number of threads
+class ChunkedRenderer {
+public:
+    using RenderItem = std::function<void(svg::Writer&, size_t)>;
+
+    ChunkedRenderer(std::ostream& out, unsigned threads, std::optional<int> precision)
+        : out_(out), threads_(threads), precision_(precision), flags_(out.flags()), stream_precision_(out.precision()) {
+    }
+
+    // tags between layers are rendered on the calling thread at once
+    void AddTags(const std::function<void(svg::Writer&)>& render_tags) {
+        if (threads_ <= 1) {
+            svg::Writer writer = MakeWriter(out_);
+            render_tags(writer);
+            return;
+        }
+        std::ostringstream tags = MakeChunkStream();
+        svg::Writer writer = MakeWriter(tags);
+        render_tags(writer);
+        parts_.emplace_back(tags.str());
+    }
+
+    // items are rendered by Finish, render_item is kept until then
+    void AddLayer(size_t count, RenderItem render_item) {
+        if (threads_ <= 1) {
+            svg::Writer writer = MakeWriter(out_);
+            for (size_t i = 0; i < count; ++i) {
+                render_item(writer, i);
+            }
+            return;
+        }
+        layers_.push_back(std::move(render_item));
+        for (size_t begin = 0; begin < count; begin += RENDER_CHUNK_SIZE) {
+            parts_.emplace_back(Chunk{layers_.size() - 1, begin, std::min(begin + RENDER_CHUNK_SIZE, count)});
+            ++chunk_count_;
+        }
+    }
+
+    // the calling thread writes parts in order as soon as they are rendered
+    void Finish() {
+        std::vector<std::promise<std::string>> rendered(parts_.size());
+        std::atomic<size_t> next_part{0};
+        auto work = [&] {
+            for (size_t i = next_part++; i < parts_.size(); i = next_part++) {
+                if (const Chunk* chunk = std::get_if<Chunk>(&parts_[i])) {
+                    try {
+                        rendered[i].set_value(RenderChunk(*chunk));
+                    } catch (...) {
+                        rendered[i].set_exception(std::current_exception());
+                    }
+                }
+            }
+        };
+        // futures of std::async join the workers before the parts go out of scope
+        std::vector<std::future<void>> workers;
+        const size_t worker_count = std::min<size_t>(threads_, chunk_count_);
+        for (size_t i = 0; i < worker_count; ++i) {
+            workers.push_back(std::async(std::launch::async, work));
+        }
+        for (size_t i = 0; i < parts_.size(); ++i) {
+            if (const std::string* tags = std::get_if<std::string>(&parts_[i])) {
+                out_ << *tags;
+            } else {
+                out_ << rendered[i].get_future().get();
+            }
+        }
+    }
+private:
+    static const size_t RENDER_CHUNK_SIZE = 256;
+
+    struct Chunk {
+        size_t layer;
+        size_t begin;
+        size_t end;
+    };
+
+    std::string RenderChunk(const Chunk& chunk) const {
+        std::ostringstream out = MakeChunkStream();
+        svg::Writer writer = MakeWriter(out);
+        for (size_t i = chunk.begin; i < chunk.end; ++i) {
+            layers_[chunk.layer](writer, i);
+        }
+        return out.str();
+    }
+
+    std::ostringstream MakeChunkStream() const {
+        std::ostringstream chunk;
+        chunk.flags(flags_);
+        chunk.precision(stream_precision_);
+        return chunk;
+    }
+
+    svg::Writer MakeWriter(std::ostream& out) const {
+        svg::Writer writer(out, svg::Writer::Mode::FRAGMENT);
+        if (precision_) {
+            writer.SetPrecision(*precision_);
+        }
+        return writer;
+    }
+
+    std::ostream& out_;
+    unsigned threads_;
+    std::optional<int> precision_;
+    std::ios_base::fmtflags flags_;
+    std::streamsize stream_precision_;
+    std::vector<RenderItem> layers_;
+    // rendered tags or chunks of layers in the output order
+    std::vector<std::variant<std::string, Chunk>> parts_;
+    size_t chunk_count_ = 0;
+};
+
+double SquaredDistanceToSegment(svg::Point point, svg::Point from, svg::Point to) {
+    const double dx = to.x - from.x;
+    const double dy = to.y - from.y;
+    const double length = dx * dx + dy * dy;
+    double t = 0;
+    if (length > 0) {
+        t = std::clamp(((point.x - from.x) * dx + (point.y - from.y) * dy) / length, 0.0, 1.0);
+    }
+    const double x = from.x + t * dx - point.x;
+    const double y = from.y + t * dy - point.y;
+    return x * x + y * y;
+}
+
+// Douglas-Peucker over stop ids [first, last), the first and the last stops are kept
+std::vector<uint32_t> SimplifyRoute(const std::vector<svg::Point>& points, std::vector<uint32_t>::const_iterator first,
+                                    std::vector<uint32_t>::const_iterator last, double tolerance) {
+    const size_t size = last - first;
+    if (size < 3) {
+        return {first, last};
+    }
+    std::vector<bool> keep(size, false);
+    keep.front() = keep.back() = true;
+    const double squared_tolerance = tolerance * tolerance;
+    std::vector<std::pair<size_t, size_t>> ranges{{0, size - 1}};
+    while (!ranges.empty()) {
+        const auto [from, to] = ranges.back();
+        ranges.pop_back();
+        double max_distance = 0;
+        size_t farthest = from;
+        for (size_t i = from + 1; i < to; ++i) {
+            const double distance = SquaredDistanceToSegment(points[first[i]], points[first[from]], points[first[to]]);
+            if (distance > max_distance) {
+                max_distance = distance;
+                farthest = i;
+            }
+        }
+        if (max_distance > squared_tolerance) {
+            keep[farthest] = true;
+            ranges.emplace_back(from, farthest);
+            ranges.emplace_back(farthest, to);
+        }
+    }
+    std::vector<uint32_t> result;
+    for (size_t i = 0; i < size; ++i) {
+        if (keep[i]) {
+            result.push_back(first[i]);
+        }
+    }
+    return result;
+}
+
+}
+
+void MapRenderer::SetSettings(render_settings settings) {
+    render_settings_ = std::move(settings);
+    cached_map_version_.reset();
+    layout_version_.reset();
+
+    std::ostringstream style;
+    style << "."sv << UNDERLAYER_CLASS << "{fill:"sv << render_settings_.underlayer_color
+          << ";stroke:"sv << render_settings_.underlayer_color << "}"sv;
+    stroke_classes_.clear();
+    fill_classes_.clear();
+    style_sizes_.assign(1, style.str().size());
+    for (size_t i = 0; i < render_settings_.color_palette.size(); ++i) {
+        stroke_classes_.push_back("c"s + std::to_string(i));
+        fill_classes_.push_back("f"s + std::to_string(i));
+        style << "."sv << stroke_classes_.back() << "{stroke:"sv << render_settings_.color_palette[i] << "}"sv
+              << "."sv << fill_classes_.back() << "{fill:"sv << render_settings_.color_palette[i] << "}"sv;
+        style_sizes_.push_back(style.str().size());
+    }
+    style_ = style.str();
+}
+
+bool IsValidMapArea(const MapArea& area) {
+    if (const MapTile* tile = std::get_if<MapTile>(&area)) {
+        if (tile->zoom < 0 || tile->zoom > MAX_TILE_ZOOM) {
+            return false;
+        }
+        const int64_t tiles = int64_t{1} << tile->zoom;
+        return tile->x >= 0 && tile->x < tiles && tile->y >= 0 && tile->y < tiles;
+    }
+    const MapBox& box = std::get<MapBox>(area);
+    return box.min.x < box.max.x && box.min.y < box.max.y;
+}
+
+MapLayout::MapLayout(const std::map<std::string_view, const Bus*>& buses_dict, double width, double height, double padding) {
+    // stops are deduplicated by address, so names are compared only to sort the unique ones
     for (const auto& [bus_name, bus_ptr] : buses_dict) {
-        svg_doc.Add(RenderBusRoute(bus_ptr, projector, route_count));
-        ++route_count;
+        stops_.insert(stops_.end(), bus_ptr->stops.begin(), bus_ptr->stops.end());
     }
-    route_count = 0;
+    std::sort(stops_.begin(), stops_.end());
+    stops_.erase(std::unique(stops_.begin(), stops_.end()), stops_.end());
+    std::sort(stops_.begin(), stops_.end(), [](const Stop* lhs, const Stop* rhs) {
+        return lhs->name < rhs->name;
+    });
+    // coordinates are copied to contiguous arrays once and projected in a batch
+    std::vector<double> lats;
+    std::vector<double> lngs;
+    lats.reserve(stops_.size());
+    lngs.reserve(stops_.size());
+    std::unordered_map<const Stop*, uint32_t> stop_ids;
+    for (const Stop* stop_ptr : stops_) {
+        stop_ids.emplace(stop_ptr, static_cast<uint32_t>(lats.size()));
+        lats.push_back(stop_ptr->coordinates.lat);
+        lngs.push_back(stop_ptr->coordinates.lng);
+    }
+    const SphereProjector projector(lats.data(), lngs.data(), stops_.size(), width, height, padding);
+    stop_points_.resize(stops_.size());
+    projector(lats.data(), lngs.data(), stops_.size(), stop_points_.data());
+
+    // stops of a bus are kept in the order the route is drawn
+    buses_.reserve(buses_dict.size());
+    bus_stops_.reserve(buses_dict.size());
     for (const auto& [bus_name, bus_ptr] : buses_dict) {
-        if (bus_ptr->stops.size() == 0) {
+        std::vector<uint32_t> bus_stops;
+        for (const Stop* stop_ptr : bus_ptr->stops) {
+            bus_stops.push_back(stop_ids.at(stop_ptr));
+        }
+        if (!bus_ptr->is_roundtrip) {
+            for (int i = static_cast<int>(bus_ptr->stops.size() - 2); i >= 0; --i) {
+                bus_stops.push_back(bus_stops[i]);
+            }
+        }
+        if (named_bus_count_ == buses_.size() && !bus_ptr->stops.empty()) {
+            ++named_bus_count_;
+        }
+        buses_.push_back(bus_ptr);
+        bus_stops_.push_back(std::move(bus_stops));
+    }
+
+    if (stops_.empty()) {
+        cell_stops_.resize(1);
+        cell_buses_.resize(1);
+        return;
+    }
+    svg::Point grid_max = stop_points_.front();
+    grid_min_ = stop_points_.front();
+    for (svg::Point point : stop_points_) {
+        grid_min_ = {std::min(grid_min_.x, point.x), std::min(grid_min_.y, point.y)};
+        grid_max = {std::max(grid_max.x, point.x), std::max(grid_max.y, point.y)};
+    }
+    const size_t grid_size = std::min(static_cast<size_t>(std::ceil(std::sqrt(stops_.size()))), MAX_GRID_SIZE);
+    if (!IsZero(grid_max.x - grid_min_.x)) {
+        columns_ = grid_size;
+        cell_width_ = (grid_max.x - grid_min_.x) / columns_;
+    }
+    if (!IsZero(grid_max.y - grid_min_.y)) {
+        rows_ = grid_size;
+        cell_height_ = (grid_max.y - grid_min_.y) / rows_;
+    }
+    cell_stops_.resize(columns_ * rows_);
+    cell_buses_.resize(columns_ * rows_);
+
+    for (uint32_t stop = 0; stop < stop_points_.size(); ++stop) {
+        const svg::Point point = stop_points_[stop];
+        cell_stops_[GetRow(point.y) * columns_ + GetColumn(point.x)].push_back(stop);
+    }
+    // a bus is put to every cell of the bounding box of each segment, the way back
+    // of a linear route repeats the segments of the way forth and is skipped
+    for (uint32_t bus = 0; bus < buses_.size(); ++bus) {
+        const std::vector<uint32_t>& bus_stops = bus_stops_[bus];
+        const size_t forth_size = buses_[bus]->stops.size();
+        for (size_t i = 0; i < forth_size; ++i) {
+            const svg::Point from = stop_points_[bus_stops[i]];
+            const svg::Point to = stop_points_[bus_stops[std::min(i + 1, forth_size - 1)]];
+            for (size_t row = GetRow(std::min(from.y, to.y)); row <= GetRow(std::max(from.y, to.y)); ++row) {
+                for (size_t column = GetColumn(std::min(from.x, to.x)); column <= GetColumn(std::max(from.x, to.x)); ++column) {
+                    std::vector<uint32_t>& cell = cell_buses_[row * columns_ + column];
+                    if (cell.empty() || cell.back() != bus) {
+                        cell.push_back(bus);
+                    }
+                }
+            }
+        }
+    }
+}
+
+size_t MapLayout::GetColumn(double x) const {
+    const double column = std::floor((x - grid_min_.x) / cell_width_);
+    return column <= 0 ? 0 : std::min(static_cast<size_t>(column), columns_ - 1);
+}
+
+size_t MapLayout::GetRow(double y) const {
+    const double row = std::floor((y - grid_min_.y) / cell_height_);
+    return row <= 0 ? 0 : std::min(static_cast<size_t>(row), rows_ - 1);
+}
+
+const std::vector<std::vector<uint32_t>>& MapLayout::GetRoutes(int level, double tolerance) {
+    if (tolerance <= 0) {
+        return bus_stops_;
+    }
+    auto [it, inserted] = routes_by_level_.try_emplace(level);
+    if (!inserted) {
+        return it->second;
+    }
+    // the tolerance in the coordinates of the whole map
+    const double map_tolerance = tolerance / static_cast<double>(int64_t{1} << level);
+    std::vector<std::vector<uint32_t>>& routes = it->second;
+    routes.reserve(buses_.size());
+    for (size_t bus = 0; bus < buses_.size(); ++bus) {
+        const std::vector<uint32_t>& bus_stops = bus_stops_[bus];
+        const auto forth_end = bus_stops.begin() + buses_[bus]->stops.size();
+        std::vector<uint32_t> route = SimplifyRoute(stop_points_, bus_stops.begin(), forth_end, map_tolerance);
+        // the way back of a linear route is the way forth reversed
+        if (forth_end != bus_stops.end()) {
+            for (int i = static_cast<int>(route.size()) - 2; i >= 0; --i) {
+                route.push_back(route[i]);
+            }
+        }
+        routes.push_back(std::move(route));
+    }
+    return routes;
+}
+
+size_t MapLayout::GetBusIndex(const Bus* bus_ptr) const {
+    return std::lower_bound(buses_.begin(), buses_.end(), bus_ptr, [](const Bus* lhs, const Bus* rhs) {
+        return lhs->name < rhs->name;
+    }) - buses_.begin();
+}
+
+void MapLayout::FindInBox(const MapBox& box, double bus_margin, std::vector<uint32_t>& stops, std::vector<uint32_t>& buses) const {
+    stops.clear();
+    buses.clear();
+    for (size_t row = GetRow(box.min.y); row <= GetRow(box.max.y); ++row) {
+        for (size_t column = GetColumn(box.min.x); column <= GetColumn(box.max.x); ++column) {
+            for (uint32_t stop : cell_stops_[row * columns_ + column]) {
+                if (IsInBox(stop_points_[stop], box)) {
+                    stops.push_back(stop);
+                }
+            }
+        }
+    }
+    // a simplified route stays within the tolerance of the stops, so the buses are looked for in a wider box
+    for (size_t row = GetRow(box.min.y - bus_margin); row <= GetRow(box.max.y + bus_margin); ++row) {
+        for (size_t column = GetColumn(box.min.x - bus_margin); column <= GetColumn(box.max.x + bus_margin); ++column) {
+            const std::vector<uint32_t>& cell = cell_buses_[row * columns_ + column];
+            buses.insert(buses.end(), cell.begin(), cell.end());
+        }
+    }
+    std::sort(stops.begin(), stops.end());
+    std::sort(buses.begin(), buses.end());
+    buses.erase(std::unique(buses.begin(), buses.end()), buses.end());
+}
+
+// stop symbols of compact SVG are <use xlink:href>
+svg::DocumentAttrs MapRenderer::GetDocumentAttrs() const {
+    svg::DocumentAttrs attrs;
+    attrs.xlink = render_settings_.compact_svg;
+    return attrs;
+}
+
+void MapRenderer::StartDocument(svg::Writer& writer, size_t bus_count, const std::optional<svg::Size>& clip_size) const {
+    if (!render_settings_.compact_svg && !clip_size) {
+        return;
+    }
+    writer.StartDefs();
+    if (render_settings_.compact_svg) {
+        svg::PathAttrs attrs;
+        attrs.fill_color = &STOP_SYMBOL_COLOR;
+        const size_t color_count = std::min(bus_count, render_settings_.color_palette.size());
+        writer.AddStyle(std::string_view(style_).substr(0, style_sizes_[color_count]));
+        writer.DefineCircle(STOP_SYMBOL_ID, render_settings_.stop_radius, attrs);
+    }
+    if (clip_size) {
+        writer.DefineClipRect(CLIP_ID, *clip_size);
+    }
+    writer.EndDefs();
+    if (clip_size) {
+        svg::GroupAttrs attrs;
+        attrs.clip_path = CLIP_ID;
+        writer.StartGroup(attrs);
+    }
+}
+
+void MapRenderer::StartLayer(svg::Writer& writer, Layer layer) const {
+    if (!render_settings_.compact_svg) {
+        return;
+    }
+    svg::GroupAttrs attrs;
+    switch (layer) {
+        case Layer::ROUTES:
+            attrs.path.fill_color = &NO_FILL_COLOR;
+            attrs.path.stroke_width = render_settings_.line_width;
+            break;
+        case Layer::BUS_NAMES:
+            attrs.translation = render_settings_.bus_label_offset;
+            attrs.font_size = render_settings_.bus_label_font_size;
+            attrs.font_family = FONT_FAMILY;
+            attrs.font_weight = BUS_NAME_FONT_WEIGHT;
+            attrs.path.stroke_width = render_settings_.underlayer_width;
+            break;
+        case Layer::STOP_SYMBOLS:
+            return;
+        case Layer::STOP_NAMES:
+            attrs.translation = render_settings_.stop_label_offset;
+            attrs.font_size = render_settings_.stop_label_font_size;
+            attrs.font_family = FONT_FAMILY;
+            attrs.path.fill_color = &STOP_NAME_COLOR;
+            attrs.path.stroke_width = render_settings_.underlayer_width;
+            break;
+    }
+    attrs.path.stroke_linecap = svg::StrokeLineCap::ROUND;
+    attrs.path.stroke_linejoin = svg::StrokeLineJoin::ROUND;
+    writer.StartGroup(attrs);
+}
+
+void MapRenderer::EndLayer(svg::Writer& writer, Layer layer) const {
+    if (render_settings_.compact_svg && layer != Layer::STOP_SYMBOLS) {
+        writer.EndGroup();
+    }
+}
+
+// in compact SVG the layer group has everything but the color, the color is a class
+svg::PathAttrs MapRenderer::GetBusRouteAttrs(int color_number) const {
+    svg::PathAttrs attrs;
+    const auto& palette = render_settings_.color_palette;
+    if (render_settings_.compact_svg && !palette.empty()) {
+        attrs.class_name = stroke_classes_[color_number % palette.size()];
+    } else if (render_settings_.compact_svg) {
+        attrs.stroke_color = &DEFAULT_BUS_COLOR;
+    } else {
+        attrs.stroke_color = palette.empty() ? &DEFAULT_BUS_COLOR : &palette[color_number % palette.size()];
+        attrs.fill_color = &NO_FILL_COLOR;
+        attrs.stroke_width = render_settings_.line_width;
+        attrs.stroke_linecap = svg::StrokeLineCap::ROUND;
+        attrs.stroke_linejoin = svg::StrokeLineJoin::ROUND;
+    }
+    return attrs;
+}
+
+svg::PathAttrs MapRenderer::GetUnderlayerAttrs() const {
+    svg::PathAttrs attrs;
+    if (render_settings_.compact_svg) {
+        attrs.class_name = UNDERLAYER_CLASS;
+    } else {
+        attrs.fill_color = &render_settings_.underlayer_color;
+        attrs.stroke_color = &render_settings_.underlayer_color;
+        attrs.stroke_width = render_settings_.underlayer_width;
+        attrs.stroke_linecap = svg::StrokeLineCap::ROUND;
+        attrs.stroke_linejoin = svg::StrokeLineJoin::ROUND;
+    }
+    return attrs;
+}
+
+void MapRenderer::RenderRoutePoints(svg::Writer& writer, const std::vector<uint32_t>& route, const std::vector<svg::Point>& points, int color_number) const {
+    writer.StartPolyline();
+    for (uint32_t stop : route) {
+        writer.AddPolylinePoint(points[stop]);
+    }
+    writer.EndPolyline(GetBusRouteAttrs(color_number));
+}
+
+// the name is drawn over its underlayer
+void MapRenderer::RenderBusName(svg::Writer& writer, const Bus* bus_ptr, svg::Point position, int color_number) const {
+    svg::TextAttrs text;
+    text.position = position;
+    if (!render_settings_.compact_svg) {
+        text.offset = render_settings_.bus_label_offset;
+        text.font_size = render_settings_.bus_label_font_size;
+        text.font_family = FONT_FAMILY;
+        text.font_weight = BUS_NAME_FONT_WEIGHT;
+    }
+    writer.AddText(text, bus_ptr->name, GetUnderlayerAttrs());
+    writer.AddText(text, bus_ptr->name, GetBusNameAttrs(color_number));
+}
+
+svg::PathAttrs MapRenderer::GetBusNameAttrs(int color_number) const {
+    svg::PathAttrs attrs;
+    const auto& palette = render_settings_.color_palette;
+    if (palette.empty()) {
+        attrs.fill_color = &DEFAULT_BUS_COLOR;
+    } else if (render_settings_.compact_svg) {
+        attrs.class_name = fill_classes_[color_number % palette.size()];
+    } else {
+        attrs.fill_color = &palette[color_number % palette.size()];
+    }
+    return attrs;
+}
+
+void MapRenderer::RenderStopSymbol(svg::Writer& writer, svg::Point position) const {
+    if (render_settings_.compact_svg) {
+        writer.AddUse(STOP_SYMBOL_ID, position);
+        return;
+    }
+    svg::PathAttrs attrs;
+    attrs.fill_color = &STOP_SYMBOL_COLOR;
+    writer.AddCircle(position, render_settings_.stop_radius, attrs);
+}
+
+// the name is drawn over its underlayer
+void MapRenderer::RenderStopName(svg::Writer& writer, const Stop* stop_ptr, svg::Point position) const {
+    svg::TextAttrs text;
+    text.position = position;
+    svg::PathAttrs attrs;
+    if (!render_settings_.compact_svg) {
+        text.offset = render_settings_.stop_label_offset;
+        text.font_size = render_settings_.stop_label_font_size;
+        text.font_family = FONT_FAMILY;
+        attrs.fill_color = &STOP_NAME_COLOR;
+    }
+    writer.AddText(text, stop_ptr->name, GetUnderlayerAttrs());
+    writer.AddText(text, stop_ptr->name, attrs);
+}
+
+// stops, their points and routes come from the layout of the catalogue version,
+// so they are sorted and projected once for all renders
+void MapRenderer::RenderBusRoutes(const std::map<std::string_view, const Bus*>& buses_dict, uint64_t catalogue_version, std::ostream& out) const {
+    MapLayout& layout = GetLayout(buses_dict, catalogue_version);
+    const std::vector<const Bus*>& buses = layout.GetBuses();
+    const std::vector<const Stop*>& stops = layout.GetStops();
+    const std::vector<svg::Point>& points = layout.GetStopPoints();
+    const std::vector<std::vector<uint32_t>>& routes = layout.GetRoutes(0, render_settings_.simplify_tolerance);
+
+    svg::Writer document(out, GetDocumentAttrs(), render_settings_.coordinate_precision);
+    StartDocument(document, buses.size());
+    ChunkedRenderer layers(out, render_threads_, render_settings_.coordinate_precision);
+    auto add_layer = [&](Layer layer, size_t count, const ChunkedRenderer::RenderItem& render_item) {
+        layers.AddTags([&](svg::Writer& writer) {
+            StartLayer(writer, layer);
+        });
+        layers.AddLayer(count, render_item);
+        layers.AddTags([&](svg::Writer& writer) {
+            EndLayer(writer, layer);
+        });
+    };
+
+    add_layer(Layer::ROUTES, routes.size(), [&](svg::Writer& writer, size_t bus) {
+        RenderRoutePoints(writer, routes[bus], points, static_cast<int>(bus));
+    });
+
+    add_layer(Layer::BUS_NAMES, layout.GetNamedBusCount(), [&](svg::Writer& writer, size_t bus) {
+        const Bus* bus_ptr = buses[bus];
+        const std::vector<uint32_t>& bus_stops = layout.GetBusStops(bus);
+        RenderBusName(writer, bus_ptr, points[bus_stops.front()], static_cast<int>(bus));
+        if (bus_ptr->stops.front() != bus_ptr->stops.back()) {
+            RenderBusName(writer, bus_ptr, points[bus_stops[bus_ptr->stops.size() - 1]], static_cast<int>(bus));
+        }
+    });
+
+    add_layer(Layer::STOP_SYMBOLS, stops.size(), [&](svg::Writer& writer, size_t stop) {
+        RenderStopSymbol(writer, points[stop]);
+    });
+    add_layer(Layer::STOP_NAMES, stops.size(), [&](svg::Writer& writer, size_t stop) {
+        RenderStopName(writer, stops[stop], points[stop]);
+    });
+    layers.Finish();
+    document.Finish();
+}
+
+const std::string& MapRenderer::RenderMap(const std::map<std::string_view, const Bus*>& buses_dict, uint64_t catalogue_version) const {
+    if (cached_map_version_ == catalogue_version) {
+        ++cache_stats_.hits;
+        return cached_map_;
+    }
+    ++cache_stats_.misses;
+    std::ostringstream rendered_map;
+    RenderBusRoutes(buses_dict, catalogue_version, rendered_map);
+    cached_map_ = rendered_map.str();
+    cached_map_version_ = catalogue_version;
+    return cached_map_;
+}
+
+void MapRenderer::SetRenderedMap(std::string rendered_map, uint64_t catalogue_version) {
+    cached_map_ = std::move(rendered_map);
+    cached_map_version_ = catalogue_version;
+}
+MapLayout& MapRenderer::GetLayout(const std::map<std::string_view, const Bus*>& buses_dict, uint64_t catalogue_version) const {
+    if (layout_version_ != catalogue_version) {
+        layout_ = MapLayout(buses_dict, render_settings_.width, render_settings_.height, render_settings_.padding);
+        layout_version_ = catalogue_version;
+    }
+    return layout_;
+}
+
+void MapRenderer::RenderMapArea(const std::map<std::string_view, const Bus*>& buses_dict, uint64_t catalogue_version,
+                                const MapArea& area, std::ostream& out) const {
+    MapLayout& layout = GetLayout(buses_dict, catalogue_version);
+    MapBox box;
+    double scale = 1;
+    int level = 0;
+    if (const MapTile* tile = std::get_if<MapTile>(&area)) {
+        level = tile->zoom;
+        scale = static_cast<double>(int64_t{1} << tile->zoom);
+        const double tile_width = render_settings_.width / scale;
+        const double tile_height = render_settings_.height / scale;
+        box.min = {tile->x * tile_width, tile->y * tile_height};
+        box.max = {box.min.x + tile_width, box.min.y + tile_height};
+    } else {
+        box = std::get<MapBox>(area);
+    }
+    auto to_area = [&box, scale](svg::Point point) {
+        return svg::Point{(point.x - box.min.x) * scale, (point.y - box.min.y) * scale};
+    };
+
+    std::vector<uint32_t> stops;
+    std::vector<uint32_t> buses;
+    const double tolerance = render_settings_.simplify_tolerance;
+    // routes are clipped to the box widened by half the line, which isn't scaled,
+    // so the strokes of segments passing just outside the area still reach into it
+    const double line_margin = render_settings_.line_width / 2 / scale;
+    const MapBox route_box{{box.min.x - line_margin, box.min.y - line_margin}, {box.max.x + line_margin, box.max.y + line_margin}};
+    layout.FindInBox(box, tolerance / scale + line_margin, stops, buses);
+    const std::vector<std::vector<uint32_t>>& routes = layout.GetRoutes(level, tolerance);
+    const std::vector<svg::Point>& points = layout.GetStopPoints();
+    // the area gets a size of its own and everything drawn is clipped to it
+    svg::DocumentAttrs document_attrs = GetDocumentAttrs();
+    document_attrs.size = svg::Size{(box.max.x - box.min.x) * scale, (box.max.y - box.min.y) * scale};
+    svg::Writer writer(out, document_attrs, render_settings_.coordinate_precision);
+    StartDocument(writer, buses.empty() ? 0 : buses.back() + 1, document_attrs.size);
+
+    // A route is cut to the runs of its segments inside the box, a run goes on while the next
+    // segment starts where the last one ended, e.g. where a route leaves the area and comes back
+    // by the same way. A route of several runs is a group with the route attributes around bare polylines
+    StartLayer(writer, Layer::ROUTES);
+    std::vector<svg::Point> run_points;
+    std::vector<size_t> run_starts;
+    std::vector<size_t> runs;
+    for (uint32_t bus : buses) {
+        const std::vector<uint32_t>& bus_stops = routes[bus];
+        if (bus_stops.empty()) {
+            continue;
+        }
+        run_points.clear();
+        run_starts.clear();
+        const size_t segment_count = std::max<size_t>(bus_stops.size(), 2) - 1;
+        for (size_t i = 0; i < segment_count; ++i) {
+            svg::Point from = points[bus_stops[i]];
+            svg::Point to = points[bus_stops[std::min(i + 1, bus_stops.size() - 1)]];
+            if (!ClipSegment(from, to, route_box)) {
+                continue;
+            }
+            if (run_points.empty() || !IsSamePoint(run_points.back(), to_area(from))) {
+                run_starts.push_back(run_points.size());
+                run_points.push_back(to_area(from));
+            }
+            if (bus_stops.size() > 1) {
+                run_points.push_back(to_area(to));
+            }
+        }
+        run_starts.push_back(run_points.size());
+        // the way back of a route that isn't a roundtrip repeats runs of the way there in reverse,
+        // one polyline is drawn the same as both
+        runs.clear();
+        for (size_t run = 0; run + 1 < run_starts.size(); ++run) {
+            const size_t first = run_starts[run];
+            const size_t size = run_starts[run + 1] - first;
+            const bool is_repeated = std::any_of(runs.begin(), runs.end(), [&](size_t kept) {
+                const size_t kept_first = run_starts[kept];
+                if (run_starts[kept + 1] - kept_first != size) {
+                    return false;
+                }
+                for (size_t i = 0; i < size; ++i) {
+                    if (!IsSamePoint(run_points[kept_first + i], run_points[first + size - 1 - i])) {
+                        return false;
+                    }
+                }
+                return true;
+            });
+            if (!is_repeated) {
+                runs.push_back(run);
+            }
+        }
+        if (runs.empty()) {
+            continue;
+        }
+        const svg::PathAttrs attrs = GetBusRouteAttrs(static_cast<int>(bus));
+        const bool is_group = runs.size() > 1;
+        if (is_group) {
+            svg::GroupAttrs group;
+            group.path = attrs;
+            writer.StartGroup(group);
+        }
+        for (size_t run : runs) {
+            writer.StartPolyline();
+            for (size_t i = run_starts[run]; i < run_starts[run + 1]; ++i) {
+                writer.AddPolylinePoint(run_points[i]);
+            }
+            writer.EndPolyline(is_group ? svg::PathAttrs{} : attrs);
+        }
+        if (is_group) {
+            writer.EndGroup();
+        }
+    }
+
+    EndLayer(writer, Layer::ROUTES);
+
+    StartLayer(writer, Layer::BUS_NAMES);
+    for (uint32_t bus : buses) {
+        if (bus >= layout.GetNamedBusCount()) {
             break;
         }
-        svg_doc.Add(RenderBusNameBase(bus_ptr, projector(bus_ptr->stops[0]->coordinates)));
-        svg_doc.Add(RenderBusName(bus_ptr, projector(bus_ptr->stops[0]->coordinates), route_count));
-        if (bus_ptr->stops[0] != bus_ptr->stops[bus_ptr->stops.size() - 1]) {
-            svg_doc.Add(RenderBusNameBase(bus_ptr,
-                                          projector(bus_ptr->stops[bus_ptr->stops.size() - 1]->coordinates)));
-            svg_doc.Add(RenderBusName(bus_ptr,
-                                      projector(bus_ptr->stops[bus_ptr->stops.size() - 1]->coordinates), route_count));
+        const Bus* bus_ptr = layout.GetBuses()[bus];
+        const std::vector<uint32_t>& bus_stops = layout.GetBusStops(bus);
+        const svg::Point first = points[bus_stops.front()];
+        if (IsInBox(first, box)) {
+            RenderBusName(writer, bus_ptr, to_area(first), static_cast<int>(bus));
+        }
+        const svg::Point last = points[bus_stops[bus_ptr->stops.size() - 1]];
+        if (bus_ptr->stops.front() != bus_ptr->stops.back() && IsInBox(last, box)) {
+            RenderBusName(writer, bus_ptr, to_area(last), static_cast<int>(bus));
         }
-        ++route_count;
     }
-    
-    for (const Stop* stop_ptr : stop_ptr_arr) {
-        svg_doc.Add(RenderStopSymbol(projector(stop_ptr->coordinates)));
+
+    EndLayer(writer, Layer::BUS_NAMES);
+
+    StartLayer(writer, Layer::STOP_SYMBOLS);
+    for (uint32_t stop : stops) {
+        RenderStopSymbol(writer, to_area(points[stop]));
+    }
+    EndLayer(writer, Layer::STOP_SYMBOLS);
+    StartLayer(writer, Layer::STOP_NAMES);
+    for (uint32_t stop : stops) {
+        RenderStopName(writer, layout.GetStops()[stop], to_area(points[stop]));
+    }
+    EndLayer(writer, Layer::STOP_NAMES);
+    writer.EndGroup();
+    writer.Finish();
+}
+
+void MapRenderer::RenderRouteOverlay(const std::map<std::string_view, const Bus*>& buses_dict, uint64_t catalogue_version,
+                                     const std::vector<RouteRide>& rides, std::ostream& out) const {
+    const MapLayout& layout = GetLayout(buses_dict, catalogue_version);
+    const std::vector<svg::Point>& points = layout.GetStopPoints();
+    // stop ids where rides start, then the final one
+    std::vector<uint32_t> stops;
+    svg::Writer writer(out, GetDocumentAttrs(), render_settings_.coordinate_precision);
+    size_t bus_count = 0;
+    for (const RouteRide& ride : rides) {
+        bus_count = std::max(bus_count, layout.GetBusIndex(ride.bus) + 1);
+    }
+    StartDocument(writer, bus_count);
+    StartLayer(writer, Layer::ROUTES);
+    for (const RouteRide& ride : rides) {
+        const size_t bus = layout.GetBusIndex(ride.bus);
+        const std::vector<uint32_t>& bus_stops = layout.GetBusStops(bus);
+        const int step = ride.is_backward ? -1 : 1;
+        writer.StartPolyline();
+        for (int i = 0; i <= ride.span_count; ++i) {
+            writer.AddPolylinePoint(points[bus_stops[ride.stop_index + i * step]]);
+        }
+        writer.EndPolyline(GetBusRouteAttrs(static_cast<int>(bus)));
+        stops.push_back(bus_stops[ride.stop_index]);
+    }
+    EndLayer(writer, Layer::ROUTES);
+    if (!rides.empty()) {
+        const RouteRide& last_ride = rides.back();
+        const int step = last_ride.is_backward ? -1 : 1;
+        stops.push_back(layout.GetBusStops(layout.GetBusIndex(last_ride.bus))[last_ride.stop_index + last_ride.span_count * step]);
+    }
+
+    StartLayer(writer, Layer::BUS_NAMES);
+    for (const RouteRide& ride : rides) {
+        const size_t bus = layout.GetBusIndex(ride.bus);
+        RenderBusName(writer, ride.bus, points[layout.GetBusStops(bus)[ride.stop_index]], static_cast<int>(bus));
+    }
+    EndLayer(writer, Layer::BUS_NAMES);
+    StartLayer(writer, Layer::STOP_SYMBOLS);
+    for (uint32_t stop : stops) {
+        RenderStopSymbol(writer, points[stop]);
     }
-    
-    for (const Stop* stop_ptr : stop_ptr_arr) {
-        svg_doc.Add(RenderStopNameBase(stop_ptr,  projector(stop_ptr->coordinates)));
-        svg_doc.Add(RenderStopName(stop_ptr,  projector(stop_ptr->coordinates)));
-        
+    EndLayer(writer, Layer::STOP_SYMBOLS);
+    StartLayer(writer, Layer::STOP_NAMES);
+    for (uint32_t stop : stops) {
+        RenderStopName(writer, layout.GetStops()[stop], points[stop]);
     }
-    
-    return svg_doc;
+    EndLayer(writer, Layer::STOP_NAMES);
+    writer.Finish();
 }
 }
 }
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <cstdint>
 #include <map>
+#include <optional>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
 #include <algorithm>
 
 #include "svg.h"
@@ -19,53 +25,21 @@ bool IsZero(double value);
 
 class SphereProjector {
 public:
-    template <typename PointInputIt>
-    SphereProjector(PointInputIt points_begin, PointInputIt points_end, double max_width,
-                    double max_height, double padding)
-        : padding_(padding) {
-            if (points_begin == points_end) {
-                return;
-            }
-
-            const auto [left_it, right_it]
-                = std::minmax_element(points_begin, points_end, [](auto lhs, auto rhs) {
-                      return lhs->coordinates.lng < rhs->coordinates.lng;
-                  });
-            min_lon_ = (*left_it)->coordinates.lng;
-            const double max_lon = (*right_it)->coordinates.lng;
-
-            const auto [bottom_it, top_it]
-                = std::minmax_element(points_begin, points_end, [](auto lhs, auto rhs) {
-                      return lhs->coordinates.lat < rhs->coordinates.lat;
-                  });
-            const double min_lat = (*bottom_it)->coordinates.lat;
-            max_lat_ = (*top_it)->coordinates.lat;
-
-            std::optional<double> width_zoom;
-            if (!IsZero(max_lon - min_lon_)) {
-                width_zoom = (max_width - 2 * padding) / (max_lon - min_lon_);
-            }
-
-            std::optional<double> height_zoom;
-            if (!IsZero(max_lat_ - min_lat)) {
-                height_zoom = (max_height - 2 * padding) / (max_lat_ - min_lat);
-            }
-
-            if (width_zoom && height_zoom) {
-                zoom_coeff_ = std::min(*width_zoom, *height_zoom);
-            } else if (width_zoom) {
-                zoom_coeff_ = *width_zoom;
-            } else if (height_zoom) {
-                zoom_coeff_ = *height_zoom;
-            }
-    }
+    // Projects points given as contiguous arrays: the bounds are found in one branchless pass
+    SphereProjector(const double* lats, const double* lngs, size_t count, double max_width,
+                    double max_height, double padding);
 
     svg::Point operator()(detail::Coordinates coords) const {
         return {(coords.lng - min_lon_) * zoom_coeff_ + padding_,
                 (max_lat_ - coords.lat) * zoom_coeff_ + padding_};
     }
 
+    // projects count points to points, the same way as one by one
+    void operator()(const double* lats, const double* lngs, size_t count, svg::Point* points) const;
+
 private:
+    void SetBounds(double min_lon, double max_lon, double min_lat, double max_lat, double max_width, double max_height);
+
     double padding_;
     double min_lon_ = 0;
     double max_lat_ = 0;
@@ -85,34 +59,181 @@ struct render_settings {
     svg::Color underlayer_color;
     double underlayer_width;
     std::vector<svg::Color> color_palette;
+    // routes are simplified until no stop is farther than this number of pixels
+    // from the drawn line, 0 draws every stop
+    double simplify_tolerance = 0;
+    // shared attributes go to <g> groups and stop symbols are <use> of one circle in <defs>
+    bool compact_svg = false;
+    // digits after the decimal point in coordinates and sizes, the stream precision if not set
+    std::optional<int> coordinate_precision{};
+};
+
+inline const int MAX_COORDINATE_PRECISION = 10;
+
+// Tile of a zoom level: the whole map is cut into 2^zoom x 2^zoom tiles,
+// the tile is rendered scaled 2^zoom times with its corner at (0, 0)
+struct MapTile {
+    int zoom = 0;
+    int x = 0;
+    int y = 0;
+};
+
+// Box in the coordinates of the whole map, it's rendered unscaled with its corner at (0, 0)
+struct MapBox {
+    svg::Point min;
+    svg::Point max;
 };
 
+using MapArea = std::variant<MapTile, MapBox>;
+
+inline const int MAX_TILE_ZOOM = 30;
+// false for tiles out of the zoom level and for empty boxes
+bool IsValidMapArea(const MapArea& area);
+
+// Part of a journey on one bus: span_count stops of the bus are passed from stops[stop_index]
+struct RouteRide {
+    const Bus* bus;
+    int stop_index;
+    int span_count;
+    bool is_backward;
+};
+
+// Stops and buses of the map projected once, with a uniform grid over the projected points:
+// every cell keeps the stops inside it and the buses whose route segments may cross it
+class MapLayout {
+public:
+    MapLayout() = default;
+    MapLayout(const std::map<std::string_view, const Bus*>& buses_dict, double width, double height, double padding);
+
+    // stops on routes sorted by name with their points
+    const std::vector<const Stop*>& GetStops() const {
+        return stops_;
+    }
+    const std::vector<svg::Point>& GetStopPoints() const {
+        return stop_points_;
+    }
+    // buses sorted by name, stops of a bus are indices of GetStops()
+    const std::vector<const Bus*>& GetBuses() const {
+        return buses_;
+    }
+    const std::vector<uint32_t>& GetBusStops(size_t bus_index) const {
+        return bus_stops_[bus_index];
+    }
+    size_t GetBusIndex(const Bus* bus_ptr) const;
+    // buses get names up to the first bus without stops, as on the whole map
+    size_t GetNamedBusCount() const {
+        return named_bus_count_;
+    }
+    // stops of every bus left by Douglas-Peucker simplification for the zoom level,
+    // the tolerance is in pixels of the level. Terminals are always kept,
+    // the routes are computed once for a level
+    const std::vector<std::vector<uint32_t>>& GetRoutes(int level, double tolerance);
+
+    // stops inside the box and buses that may pass closer than bus_margin to it, both in ascending order
+    void FindInBox(const MapBox& box, double bus_margin, std::vector<uint32_t>& stops, std::vector<uint32_t>& buses) const;
+private:
+    size_t GetColumn(double x) const;
+    size_t GetRow(double y) const;
+
+    std::vector<const Stop*> stops_;
+    std::vector<svg::Point> stop_points_;
+    std::vector<const Bus*> buses_;
+    std::vector<std::vector<uint32_t>> bus_stops_;
+    size_t named_bus_count_ = 0;
+    std::map<int, std::vector<std::vector<uint32_t>>> routes_by_level_;
+
+    svg::Point grid_min_;
+    double cell_width_ = 1;
+    double cell_height_ = 1;
+    size_t columns_ = 1;
+    size_t rows_ = 1;
+    std::vector<std::vector<uint32_t>> cell_stops_;
+    std::vector<std::vector<uint32_t>> cell_buses_;
+};
+
+// Not thread-safe: the const render methods fill the map cache and the layout,
+// so one renderer must not be used from several threads at once
 class MapRenderer {
 public:
-    MapRenderer() {
-        
+    // layers of the map are rendered in chunks on a pool of up to render_threads threads,
+    // render_settings of make_base may set it as "render_threads", the base doesn't keep it
+    explicit MapRenderer(unsigned render_threads = std::thread::hardware_concurrency())
+        : render_threads_(render_threads) {
     }
     
-    void SetSettings(render_settings settings) {
-        render_settings_ = settings;
+    struct CacheStats {
+        size_t hits = 0;
+        size_t misses = 0;
+    };
+
+    // new settings drop the cached map
+    void SetSettings(render_settings settings);
+
+    // SVG of the map. It's rendered once for every version of stops and buses
+    // of the catalogue and every settings, then it's taken from the cache
+    const std::string& RenderMap(const std::map<std::string_view, const Bus*>& buses_dict, uint64_t catalogue_version) const;
+    // puts the map rendered for the catalogue version with current settings to the cache
+    void SetRenderedMap(std::string rendered_map, uint64_t catalogue_version);
+    // hits and misses of RenderMap, printed by process_requests in a TRANSPORT_CATALOGUE_STATS build
+    CacheStats GetCacheStats() const {
+        return cache_stats_;
     }
     
-    render_settings GetSettings();
-    svg::Document RenderBusRoutes(const std::map<std::string_view, const Bus*>& buses_dict) const;
+    // SVG of the part of the map: only buses and stops found in the area through the layout index
+    // are drawn, routes are clipped to the area
+    void RenderMapArea(const std::map<std::string_view, const Bus*>& buses_dict, uint64_t catalogue_version,
+                       const MapArea& area, std::ostream& out) const;
+
+    // SVG of a journey alone, drawn with the projection and the colors of the whole map:
+    // every ride in the color of its bus, labelled at the stop it starts from,
+    // and the stops where rides start and the journey ends
+    void RenderRouteOverlay(const std::map<std::string_view, const Bus*>& buses_dict, uint64_t catalogue_version,
+                            const std::vector<RouteRide>& rides, std::ostream& out) const;
+
+    render_settings GetSettings() const;
+    // the output doesn't depend on the number of threads, 0 and 1 render on the calling thread
+    void SetRenderThreads(unsigned render_threads) {
+        render_threads_ = render_threads;
+    }
+    // writes the SVG of the map straight to out
+    void RenderBusRoutes(const std::map<std::string_view, const Bus*>& buses_dict, uint64_t catalogue_version, std::ostream& out) const;
 private:
-    void CreateBusNameText(svg::Text& route_name_base,
-                                svg::Text& route_name,
-                                svg::Point position,
-                                const std::string& bus_name,
-                                        int bus_count) const;
-    svg::Polyline RenderBusRoute(const Bus* bus_ptr,  SphereProjector& projector, int color_number) const;
-    svg::Text RenderBusNameBase(const Bus* bus_ptr,  svg::Point position) const;
-    svg::Text RenderBusName(const Bus* bus_ptr,  svg::Point position, int color_number) const;
-    svg::Circle RenderStopSymbol(svg::Point position) const;
-    svg::Text RenderStopNameBase(const Stop* stop_ptr, svg::Point position) const;
-    svg::Text RenderStopName(const Stop* stop_ptr, svg::Point position) const;
+    MapLayout& GetLayout(const std::map<std::string_view, const Bus*>& buses_dict, uint64_t catalogue_version) const;
+    enum class Layer {
+        ROUTES,
+        BUS_NAMES,
+        STOP_SYMBOLS,
+        STOP_NAMES
+    };
+
+    svg::DocumentAttrs GetDocumentAttrs() const;
+    // for compact SVG the styles of colors of the first bus_count buses and the stop symbol definition.
+    // With clip_size also the clip rect and the group clipped to it, which the caller ends
+    void StartDocument(svg::Writer& writer, size_t bus_count, const std::optional<svg::Size>& clip_size = std::nullopt) const;
+    // groups with attributes shared by the elements of a layer, only for compact SVG
+    void StartLayer(svg::Writer& writer, Layer layer) const;
+    void EndLayer(svg::Writer& writer, Layer layer) const;
+    svg::PathAttrs GetBusRouteAttrs(int color_number) const;
+    svg::PathAttrs GetUnderlayerAttrs() const;
+    svg::PathAttrs GetBusNameAttrs(int color_number) const;
+    void RenderRoutePoints(svg::Writer& writer, const std::vector<uint32_t>& route, const std::vector<svg::Point>& points, int color_number) const;
+    void RenderBusName(svg::Writer& writer, const Bus* bus_ptr, svg::Point position, int color_number) const;
+    void RenderStopSymbol(svg::Writer& writer, svg::Point position) const;
+    void RenderStopName(svg::Writer& writer, const Stop* stop_ptr, svg::Point position) const;
     
     render_settings render_settings_;
+    unsigned render_threads_;
+    // compact SVG: CSS of the underlayer and the palette, size of the CSS with the first i colors,
+    // class names of palette colors for route strokes and bus name fills
+    std::string style_;
+    std::vector<size_t> style_sizes_;
+    std::vector<std::string> stroke_classes_;
+    std::vector<std::string> fill_classes_;
+    mutable std::string cached_map_;
+    mutable std::optional<uint64_t> cached_map_version_;
+    mutable CacheStats cache_stats_;
+    mutable MapLayout layout_;
+    mutable std::optional<uint64_t> layout_version_;
 };
 
 }
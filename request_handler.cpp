@@ -27,8 +27,22 @@ std::optional<TransportRouter::RouteItems> RequestHandler::GetRouteByStops(const
     return router_.GetRouteByStops(db_.GetStopByName(start_stop), db_.GetStopByName(finish_stop));
 }
 
-svg::Document RequestHandler::RenderMap() const {
-    return renderer_.RenderBusRoutes(db_.GetAllBuses());
+void RequestHandler::RenderMap(std::ostream& out) const {
+    out << renderer_.RenderMap(db_.GetAllBuses(), db_.GetStopsAndBusesVersion());
+}
+
+void RequestHandler::RenderMapArea(const renderer::MapArea& area, std::ostream& out) const {
+    renderer_.RenderMapArea(db_.GetAllBuses(), db_.GetStopsAndBusesVersion(), area, out);
+}
+
+void RequestHandler::RenderRouteOverlay(const TransportRouter::RouteItems& route, std::ostream& out) const {
+    std::vector<renderer::RouteRide> rides;
+    for (const TransportRouter::Item& item : route.items) {
+        if (item.type == TransportRouter::ItemType::BUS) {
+            rides.push_back({item.bus, item.stop_index, item.span_count, item.is_backward});
+        }
+    }
+    renderer_.RenderRouteOverlay(db_.GetAllBuses(), db_.GetStopsAndBusesVersion(), rides, out);
 }
 }
 }
@@ -33,7 +33,12 @@ public:
     
     // Возвращает маршруты, проходящие через
     std::optional<std::vector<std::string_view>>  GetBusesByStop(const std::string_view& stop_name) const;
-    svg::Document RenderMap() const;
+    // Выводит SVG карты, уже отрисованная карта берётся из кэша визуализатора
+    void RenderMap(std::ostream& out) const;
+    // Выводит SVG части карты: плитки уровня масштаба или прямоугольника в координатах всей карты
+    void RenderMapArea(const renderer::MapArea& area, std::ostream& out) const;
+    // Выводит SVG одного маршрута поверх карты: поездки в цветах автобусов и остановки пересадок
+    void RenderRouteOverlay(const TransportRouter::RouteItems& route, std::ostream& out) const;
 
 private:
     // RequestHandler использует агрегацию объектов "Транспортный Справочник" и "Визуализатор Карты"
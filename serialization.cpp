@@ -1,12 +1,31 @@
 #include "serialization.h"
+#include "alloc_counter.h"
+#include "flat_base.h"
 #include "transport_catalogue.pb.h"
 
+#include <google/protobuf/arena.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
 #include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
 
 namespace transport_catalogue {
 
-void Serializer::SetSettings(std::string file_name) {
+void Serializer::SetSettings(std::string file_name, Format format) {
     file_name_ = std::move(file_name);
+    format_ = format;
 }
 
 transport_catalogue_serialize::Stop CreateSerializeStop(const Stop* stop_ptr) {
@@ -17,20 +36,22 @@ transport_catalogue_serialize::Stop CreateSerializeStop(const Stop* stop_ptr) {
     return stop;
 }
 
-transport_catalogue_serialize::Bus CreateSerializeBus(const Bus* bus_ptr) {
+using StopIds = std::unordered_map<const Stop*, uint32_t>;
+
+transport_catalogue_serialize::Bus CreateSerializeBus(const StopIds& stop_ids, const Bus* bus_ptr) {
     transport_catalogue_serialize::Bus bus;
     bus.set_name(bus_ptr->name);
     bus.set_is_roundtrip(bus_ptr->is_roundtrip);
     for(const Stop* stop_ptr : bus_ptr->stops) {
-        bus.add_stops(reinterpret_cast<uint64_t>(stop_ptr));
+        bus.add_stops(stop_ids.at(stop_ptr));
     }
     return bus;
 }
 
-transport_catalogue_serialize::StopDistance CreateSerializeDistance(const Stop* src_stop_ptr, const Stop* dst_stop_ptr, int64_t distance) {
+transport_catalogue_serialize::StopDistance CreateSerializeDistance(uint32_t src_stop_id, uint32_t dst_stop_id, int64_t distance) {
     transport_catalogue_serialize::StopDistance stop_dist;
-    stop_dist.set_src(reinterpret_cast<uint64_t>(src_stop_ptr));
-    stop_dist.set_dst(reinterpret_cast<uint64_t>(dst_stop_ptr));
+    stop_dist.set_src(src_stop_id);
+    stop_dist.set_dst(dst_stop_id);
     stop_dist.set_distance(distance);
     return stop_dist;
 }
@@ -72,6 +93,11 @@ transport_catalogue_serialize::RenderSettings CreateSerializeRenderSettings(rend
     for (const auto& color : settings.color_palette) {
         *serialized_settings.add_color_palette() = CreateSerializeColor(color);
     }
+    serialized_settings.set_simplify_tolerance(settings.simplify_tolerance);
+    serialized_settings.set_compact_svg(settings.compact_svg);
+    if (settings.coordinate_precision) {
+        serialized_settings.set_coordinate_precision(*settings.coordinate_precision);
+    }
     return serialized_settings;
 }
 
@@ -82,25 +108,23 @@ transport_catalogue_serialize::RouterSettings CreateSerializeRouterSettings(Tran
     return serialized_settings;
 }
     
-Stop CreateStopFromSerialized(const transport_catalogue_serialize::Stop& stop) {
-    return {stop.name(), {stop.coordinates().lat(), stop.coordinates().lng()}};
+// Names are moved out of the messages, they are not used after extraction
+Stop CreateStopFromSerialized(transport_catalogue_serialize::Stop& stop) {
+    return {std::move(*stop.mutable_name()), {stop.coordinates().lat(), stop.coordinates().lng()}};
 }
 
-Bus CreateBusFromSerialized(const TransportCatalogue& db, transport_catalogue_serialize::TransportCatalogue& catalog, const transport_catalogue_serialize::Bus& bus) {
+Bus CreateBusFromSerialized(const std::vector<const Stop*>& stops, transport_catalogue_serialize::Bus& bus) {
     Bus bus_result;
-    bus_result.name = bus.name();
+    bus_result.name = std::move(*bus.mutable_name());
     bus_result.is_roundtrip = bus.is_roundtrip();
+    bus_result.stops.reserve(bus.stops_size());
     for (const auto stops_id : bus.stops()) {
-        bus_result.stops.push_back(db.GetStopByName((*catalog.mutable_stops())[stops_id].name()));
+        bus_result.stops.push_back(stops.at(stops_id));
     }
     return bus_result;
     
 }
 
-const Stop* GetStopPtrFromId(const TransportCatalogue& db, transport_catalogue_serialize::TransportCatalogue& catalog, uint64_t stops_id) {
-    return db.GetStopByName((*catalog.mutable_stops())[stops_id].name());
-}
-
 svg::Color CreateColorFromSerialized(transport_catalogue_serialize::Color color) {
     if (color.has_rgb_value()) {
         svg::Rgb rgb_color;
@@ -141,6 +165,11 @@ renderer::render_settings CreateRenderSettings(const transport_catalogue_seriali
     for(const auto& color : settings.color_palette()) {
         unserialised_settings.color_palette.push_back(CreateColorFromSerialized(color));
     }
+    unserialised_settings.simplify_tolerance = settings.simplify_tolerance();
+    unserialised_settings.compact_svg = settings.compact_svg();
+    if (settings.has_coordinate_precision()) {
+        unserialised_settings.coordinate_precision = settings.coordinate_precision();
+    }
     return unserialised_settings;
 }
 
@@ -148,43 +177,616 @@ TransportRouter::RouterSettings CreateRouterSettings(const transport_catalogue_s
     return {settings.time(), settings.velocity()};
 }
 
+using StopDistances = std::vector<std::tuple<uint32_t, uint32_t, int64_t>>;
+
+// Stops get ids in the order they were added
+StopIds GetStopIds(const TransportCatalogue& db) {
+    StopIds stop_ids;
+    stop_ids.reserve(db.GetStops().size());
+    for (const Stop& stop : db.GetStops()) {
+        const uint32_t stop_id = static_cast<uint32_t>(stop_ids.size());
+        stop_ids[&stop] = stop_id;
+    }
+    return stop_ids;
+}
+
+// Distances are sorted by stop ids so the same catalogue always gives the same file
+StopDistances GetSortedDistances(const TransportCatalogue& db, const StopIds& stop_ids) {
+    StopDistances distances;
+    distances.reserve(db.GetStopDistances().size());
+    for(const auto& [stop_ptrs, distance] : db.GetStopDistances()) {
+        distances.emplace_back(stop_ids.at(stop_ptrs.first), stop_ids.at(stop_ptrs.second), distance);
+    }
+    std::sort(distances.begin(), distances.end());
+    return distances;
+}
+
+// Compact encoding keeps coordinates as fixed-point numbers and ids as differences,
+// so most of the numbers become one or two byte varints
+constexpr double COORDINATE_SCALE = 1e7;
+
+int64_t ToFixedPoint(double degrees) {
+    return std::llround(degrees * COORDINATE_SCALE);
+}
+
+double FromFixedPoint(int64_t value) {
+    return static_cast<double>(value) / COORDINATE_SCALE;
+}
+
+void AddCompactStops(transport_catalogue_serialize::TransportCatalogue& catalog, const TransportCatalogue& db) {
+    int64_t prev_lat = 0;
+    int64_t prev_lng = 0;
+    for (const Stop& stop : db.GetStops()) {
+        const int64_t lat = ToFixedPoint(stop.coordinates.lat);
+        const int64_t lng = ToFixedPoint(stop.coordinates.lng);
+        auto& compact_stop = *catalog.add_compact_stops();
+        compact_stop.set_name(stop.name);
+        if (FromFixedPoint(lat) != stop.coordinates.lat || FromFixedPoint(lng) != stop.coordinates.lng) {
+            compact_stop.mutable_exact()->set_lat(stop.coordinates.lat);
+            compact_stop.mutable_exact()->set_lng(stop.coordinates.lng);
+            continue;
+        }
+        compact_stop.set_lat(lat - prev_lat);
+        compact_stop.set_lng(lng - prev_lng);
+        prev_lat = lat;
+        prev_lng = lng;
+    }
+}
+
+void AddCompactBuses(transport_catalogue_serialize::TransportCatalogue& catalog, const TransportCatalogue& db, const StopIds& stop_ids) {
+    for (const auto& [name, bus_ptr] : db.GetAllBuses()) {
+        auto& compact_bus = *catalog.add_compact_buses();
+        compact_bus.set_name(bus_ptr->name);
+        compact_bus.set_is_roundtrip(bus_ptr->is_roundtrip);
+        compact_bus.mutable_stops()->Reserve(static_cast<int>(bus_ptr->stops.size()));
+        int64_t prev_id = 0;
+        for (const Stop* stop_ptr : bus_ptr->stops) {
+            const int64_t id = stop_ids.at(stop_ptr);
+            compact_bus.add_stops(id - prev_id);
+            prev_id = id;
+        }
+    }
+}
+
+// distances must be sorted by (src, dst)
+void AddCompactDistances(transport_catalogue_serialize::TransportCatalogue& catalog, const StopDistances& distances) {
+    transport_catalogue_serialize::CompactStopDistances* group = nullptr;
+    uint32_t prev_src = 0;
+    uint32_t prev_dst = 0;
+    for (const auto& [src, dst, distance] : distances) {
+        if (group == nullptr || src != prev_src) {
+            group = catalog.add_compact_distances();
+            group->set_src(src - prev_src);
+            prev_src = src;
+            prev_dst = 0;
+        }
+        group->add_dst(dst - prev_dst);
+        group->add_distance(static_cast<uint64_t>(distance));
+        prev_dst = dst;
+    }
+}
+
+// Compact stops, buses and distances go after the plain ones, stop ids continue the numbering
+void ExtractCompactCatalogue(TransportCatalogue& db, transport_catalogue_serialize::TransportCatalogue& catalog, std::vector<const Stop*>& stops) {
+    int64_t lat = 0;
+    int64_t lng = 0;
+    for (auto& compact_stop : *catalog.mutable_compact_stops()) {
+        if (compact_stop.has_exact()) {
+            db.AddStop({std::move(*compact_stop.mutable_name()), {compact_stop.exact().lat(), compact_stop.exact().lng()}});
+            stops.push_back(&db.GetStops().back());
+            continue;
+        }
+        lat += compact_stop.lat();
+        lng += compact_stop.lng();
+        db.AddStop({std::move(*compact_stop.mutable_name()), {FromFixedPoint(lat), FromFixedPoint(lng)}});
+        stops.push_back(&db.GetStops().back());
+    }
+    for (auto& compact_bus : *catalog.mutable_compact_buses()) {
+        Bus bus;
+        bus.name = std::move(*compact_bus.mutable_name());
+        bus.is_roundtrip = compact_bus.is_roundtrip();
+        bus.stops.reserve(compact_bus.stops_size());
+        int64_t id = 0;
+        for (const int64_t delta : compact_bus.stops()) {
+            id += delta;
+            bus.stops.push_back(stops.at(static_cast<size_t>(id)));
+        }
+        db.AddBus(std::move(bus));
+    }
+    uint32_t src = 0;
+    for (const auto& group : catalog.compact_distances()) {
+        src += group.src();
+        if (group.dst_size() != group.distance_size()) {
+            throw std::runtime_error("Broken compact distances");
+        }
+        uint32_t dst = 0;
+        for (int i = 0; i < group.dst_size(); ++i) {
+            dst += group.dst(i);
+            db.SetDistanceBetweenStops(stops.at(src), stops.at(dst), static_cast<int64_t>(group.distance(i)));
+        }
+    }
+}
+
+// A stream base is the magic followed by length-delimited TransportCatalogue messages,
+// each of them has a part of the stops, buses or distances. Stops go first,
+// the last message has the settings and the parent checksum
+constexpr char STREAM_MAGIC[8] = {'T', 'C', 'S', 'T', 'R', 'M', '0', '1'};
+constexpr int STREAM_CHUNK_SIZE = 1024;
+// enough for a chunk of 1024 stops with their messages
+constexpr size_t ARENA_BLOCK_SIZE = 256 * 1024;
+
+bool IsStreamBase(const char* data, size_t size) {
+    return size >= sizeof(STREAM_MAGIC) && std::memcmp(data, STREAM_MAGIC, sizeof(STREAM_MAGIC)) == 0;
+}
+
+void WriteChunk(google::protobuf::io::CodedOutputStream& output, transport_catalogue_serialize::TransportCatalogue& chunk) {
+    output.WriteVarint32(static_cast<uint32_t>(chunk.ByteSizeLong()));
+    chunk.SerializeWithCachedSizes(&output);
+    chunk.Clear();
+}
+
+// CRC-32 as in zlib, so a checksum can be checked with common tools
+uint32_t Crc32(const char* data, size_t size) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> result{};
+        for (uint32_t i = 0; i < result.size(); ++i) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                value = (value & 1) ? (value >> 1) ^ 0xEDB88320u : value >> 1;
+            }
+            result[i] = value;
+        }
+        return result;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFFu] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+std::string TakeRenderedMap(std::future<std::string>& rendered_map) {
+    return rendered_map.valid() ? rendered_map.get() : std::string();
+}
+
+// The map needs render settings, without a palette there is nothing to render with
+std::future<std::string> Serializer::RenderMapAsync() const {
+    if (renderer_.GetSettings().color_palette.empty()) {
+        return {};
+    }
+    return std::async(std::launch::async, [this] {
+        std::ostringstream rendered_map;
+        renderer_.RenderBusRoutes(db_.GetAllBuses(), db_.GetStopsAndBusesVersion(), rendered_map);
+        return rendered_map.str();
+    });
+}
+
 void Serializer::SerializeBaseToFile() {
     std::ofstream output(file_name_, std::ios::binary);
-    transport_catalogue_serialize::TransportCatalogue serialized_catalogue;
-    for (const auto& [name, stop_ptr] : db_.GetAllStops()) {
-        (*serialized_catalogue.mutable_stops())[reinterpret_cast<uint64_t>(stop_ptr)] = CreateSerializeStop(stop_ptr);
+    // the renderer isn't thread-safe, so its settings are copied before the map is rendered on another thread
+    const renderer::render_settings render_settings = renderer_.GetSettings();
+    std::future<std::string> rendered_map = RenderMapAsync();
+    if (format_ == Format::FLAT) {
+        SerializeFlatBase(output, render_settings, rendered_map);
+    } else if (format_ == Format::STREAM) {
+        SerializeStreamBase(output, render_settings, rendered_map);
+    } else {
+        SerializeProtobufBase(output, render_settings, rendered_map);
     }
-    for (const auto& [name, bus_ptr] : db_.GetAllBuses()) {
-        *serialized_catalogue.add_buses() = CreateSerializeBus(bus_ptr);
+}
+
+void Serializer::DeserializeBaseFromFile() {
+    OpenBase();
+    LoadDistances();
+    LoadSettings();
+}
+
+void Serializer::OpenBase() {
+    base_ = std::make_unique<flat_base::MappedFile>(file_name_);
+    DeserializeOpenBase();
+}
+
+void Serializer::SetParentBase(std::string file_name, std::optional<uint32_t> expected_checksum) {
+    parent_file_name_ = std::move(file_name);
+    expected_parent_checksum_ = expected_checksum;
+}
+
+void Serializer::LoadParentBase() {
+    if (parent_file_name_.empty()) {
+        return;
+    }
+    base_ = std::make_unique<flat_base::MappedFile>(parent_file_name_);
+    const uint32_t checksum = Crc32(base_->Data(), base_->Size());
+    if (expected_parent_checksum_ && *expected_parent_checksum_ != checksum) {
+        throw std::runtime_error("Checksum of base " + parent_file_name_ + " doesn't match base_checksum");
     }
-    for(const auto& [stop_ptrs, distance] : db_.GetStopDistances()) {
-        *serialized_catalogue.add_distances() = CreateSerializeDistance(stop_ptrs.first, stop_ptrs.second, distance);
+    DeserializeOpenBase();
+    LoadDistances();
+    LoadSettings();
+    // the new base may replace the parent file
+    base_.reset();
+    parent_checksum_ = checksum;
+}
+
+void Serializer::DeserializeOpenBase() {
+    alloc_counter::Scope allocations("base load");
+    if (flat_base::IsFlatBase(base_->Data(), base_->Size())) {
+        DeserializeFlatStopsAndBuses();
+        distances_loaded_ = false;
+        settings_loaded_ = false;
+    } else {
+        if (IsStreamBase(base_->Data(), base_->Size())) {
+            DeserializeStreamBase(base_->Data(), base_->Size());
+        } else {
+            DeserializeProtobufBase(base_->Data(), base_->Size());
+        }
+        base_.reset();
+        distances_loaded_ = true;
+        settings_loaded_ = true;
+    }
+}
+
+void Serializer::LoadDistances() {
+    if (!distances_loaded_) {
+        alloc_counter::Scope allocations("distances load");
+        DeserializeFlatDistances();
+        distances_loaded_ = true;
+    }
+}
+
+void Serializer::LoadSettings() {
+    if (!settings_loaded_) {
+        alloc_counter::Scope allocations("settings load");
+        DeserializeFlatSettings();
+        settings_loaded_ = true;
+    }
+}
+
+void Serializer::SerializeProtobufBase(std::ostream& output, const renderer::render_settings& render_settings,
+                                       std::future<std::string>& rendered_map) const {
+    transport_catalogue_serialize::TransportCatalogue serialized_catalogue;
+    const StopIds stop_ids = GetStopIds(db_);
+    if (format_ == Format::COMPACT) {
+        AddCompactStops(serialized_catalogue, db_);
+        AddCompactBuses(serialized_catalogue, db_, stop_ids);
+        AddCompactDistances(serialized_catalogue, GetSortedDistances(db_, stop_ids));
+    } else {
+        for (const Stop& stop : db_.GetStops()) {
+            *serialized_catalogue.add_stops() = CreateSerializeStop(&stop);
+        }
+        for (const auto& [name, bus_ptr] : db_.GetAllBuses()) {
+            *serialized_catalogue.add_buses() = CreateSerializeBus(stop_ids, bus_ptr);
+        }
+        for (const auto& [src, dst, distance] : GetSortedDistances(db_, stop_ids)) {
+            *serialized_catalogue.add_distances() = CreateSerializeDistance(src, dst, distance);
+        }
     }
-    *serialized_catalogue.mutable_render_settings() = CreateSerializeRenderSettings(renderer_.GetSettings());
+    *serialized_catalogue.mutable_render_settings() = CreateSerializeRenderSettings(render_settings);
     *serialized_catalogue.mutable_router_settings() = CreateSerializeRouterSettings(router_.GetSettings());
+    serialized_catalogue.set_parent_checksum(parent_checksum_);
+    serialized_catalogue.set_rendered_map(TakeRenderedMap(rendered_map));
     serialized_catalogue.SerializeToOstream(&output);
 }
 
-void Serializer::DeserializeBaseFromFile() {
-    std::ifstream input(file_name_, std::ios::binary);
-    // extract stops
-    transport_catalogue_serialize::TransportCatalogue serialized_catalogue;
-    serialized_catalogue.ParseFromIstream(&input);
-    for(const auto& [stop_ptr, stop] : serialized_catalogue.stops()) {
+// Messages are parsed on an arena, so their objects are allocated in a few blocks
+// and freed at once. Blocks are about the size of the data to parse
+google::protobuf::ArenaOptions GetArenaOptions(size_t size) {
+    google::protobuf::ArenaOptions arena_options;
+    arena_options.start_block_size = std::max<size_t>(size, arena_options.start_block_size);
+    arena_options.max_block_size = std::max<size_t>(size, arena_options.max_block_size);
+    return arena_options;
+}
+
+void Serializer::DeserializeProtobufBase(const char* data, size_t size) {
+    google::protobuf::Arena arena(GetArenaOptions(size));
+    auto* serialized_catalogue = google::protobuf::Arena::CreateMessage<transport_catalogue_serialize::TransportCatalogue>(&arena);
+    if (!serialized_catalogue->ParseFromArray(data, static_cast<int>(size))) {
+        throw std::runtime_error("Broken base file " + file_name_);
+    }
+    std::vector<const Stop*> stops;
+    stops.reserve(serialized_catalogue->stops_size() + serialized_catalogue->compact_stops_size());
+    ExtractCatalogue(*serialized_catalogue, stops);
+}
+
+void Serializer::SerializeStreamBase(std::ostream& output, const renderer::render_settings& render_settings,
+                                     std::future<std::string>& rendered_map) const {
+    google::protobuf::io::OstreamOutputStream raw_output(&output);
+    google::protobuf::io::CodedOutputStream coded_output(&raw_output);
+    coded_output.WriteRaw(STREAM_MAGIC, sizeof(STREAM_MAGIC));
+
+    const StopIds stop_ids = GetStopIds(db_);
+    transport_catalogue_serialize::TransportCatalogue chunk;
+    for (const Stop& stop : db_.GetStops()) {
+        *chunk.add_stops() = CreateSerializeStop(&stop);
+        if (chunk.stops_size() == STREAM_CHUNK_SIZE) {
+            WriteChunk(coded_output, chunk);
+        }
+    }
+    for (const auto& [name, bus_ptr] : db_.GetAllBuses()) {
+        if (chunk.stops_size() > 0) {
+            WriteChunk(coded_output, chunk);
+        }
+        *chunk.add_buses() = CreateSerializeBus(stop_ids, bus_ptr);
+        if (chunk.buses_size() == STREAM_CHUNK_SIZE) {
+            WriteChunk(coded_output, chunk);
+        }
+    }
+    for (const auto& [src, dst, distance] : GetSortedDistances(db_, stop_ids)) {
+        *chunk.add_distances() = CreateSerializeDistance(src, dst, distance);
+        if (chunk.distances_size() == STREAM_CHUNK_SIZE) {
+            WriteChunk(coded_output, chunk);
+        }
+    }
+    if (chunk.ByteSizeLong() > 0) {
+        WriteChunk(coded_output, chunk);
+    }
+    *chunk.mutable_render_settings() = CreateSerializeRenderSettings(render_settings);
+    *chunk.mutable_router_settings() = CreateSerializeRouterSettings(router_.GetSettings());
+    chunk.set_parent_checksum(parent_checksum_);
+    chunk.set_rendered_map(TakeRenderedMap(rendered_map));
+    WriteChunk(coded_output, chunk);
+}
+
+// Only one message is in memory at a time, the arena blocks are reused for every one
+void Serializer::DeserializeStreamBase(const char* data, size_t size) {
+    size_t position = sizeof(STREAM_MAGIC);
+    std::vector<const Stop*> stops;
+    std::vector<char> arena_block(ARENA_BLOCK_SIZE);
+    google::protobuf::ArenaOptions arena_options = GetArenaOptions(ARENA_BLOCK_SIZE);
+    arena_options.initial_block = arena_block.data();
+    arena_options.initial_block_size = arena_block.size();
+    google::protobuf::Arena arena(arena_options);
+    while (position < size) {
+        arena.Reset();
+        auto& chunk = *google::protobuf::Arena::CreateMessage<transport_catalogue_serialize::TransportCatalogue>(&arena);
+        const size_t available = std::min<size_t>(size - position, std::numeric_limits<int>::max());
+        google::protobuf::io::CodedInputStream input(reinterpret_cast<const uint8_t*>(data + position), static_cast<int>(available));
+        uint32_t chunk_size = 0;
+        if (!input.ReadVarint32(&chunk_size)) {
+            throw std::runtime_error("Broken base file " + file_name_);
+        }
+        position += input.CurrentPosition();
+        if (chunk_size > size - position || !chunk.ParseFromArray(data + position, static_cast<int>(chunk_size))) {
+            throw std::runtime_error("Broken base file " + file_name_);
+        }
+        position += chunk_size;
+        ExtractCatalogue(chunk, stops);
+    }
+}
+
+// Adds everything a message has to the catalogue, stop ids continue the numbering of stops.
+// Settings and the parent checksum are kept in the message with the settings
+void Serializer::ExtractCatalogue(transport_catalogue_serialize::TransportCatalogue& serialized_catalogue, std::vector<const Stop*>& stops) {
+    // extract stops, position in the file is the stop id
+    for(auto& stop : *serialized_catalogue.mutable_stops()) {
         db_.AddStop(CreateStopFromSerialized(stop));
+        stops.push_back(&db_.GetStops().back());
     }
     // extract buses
-    for (const auto& bus : serialized_catalogue.buses()) {
-        db_.AddBus(CreateBusFromSerialized(db_, serialized_catalogue, bus));
+    for (auto& bus : *serialized_catalogue.mutable_buses()) {
+        db_.AddBus(CreateBusFromSerialized(stops, bus));
     }
     // set distances
     for (const auto& distance_info : serialized_catalogue.distances()) {
-        db_.SetDistanceBetweenStops(GetStopPtrFromId(db_, serialized_catalogue, distance_info.src()),
-                                    GetStopPtrFromId(db_, serialized_catalogue, distance_info.dst()),
+        db_.SetDistanceBetweenStops(stops.at(distance_info.src()),
+                                    stops.at(distance_info.dst()),
                                     distance_info.distance());
     }
-    renderer_.SetSettings(CreateRenderSettings(serialized_catalogue.render_settings()));
-    router_.SetSettings(CreateRouterSettings(serialized_catalogue.router_settings()));
+    ExtractCompactCatalogue(db_, serialized_catalogue, stops);
+    if (serialized_catalogue.has_render_settings() || serialized_catalogue.has_router_settings()) {
+        renderer_.SetSettings(CreateRenderSettings(serialized_catalogue.render_settings()));
+        router_.SetSettings(CreateRouterSettings(serialized_catalogue.router_settings()));
+        parent_checksum_ = serialized_catalogue.parent_checksum();
+        if (!serialized_catalogue.rendered_map().empty()) {
+            renderer_.SetRenderedMap(std::move(*serialized_catalogue.mutable_rendered_map()), db_.GetStopsAndBusesVersion());
+        }
+    }
+}
+
+namespace {
+
+// Collects the sections of a flat base in memory and writes them with the header and the table
+class FlatBaseWriter {
+public:
+    template <typename Record>
+    void SetSection(flat_base::Section section, const std::vector<Record>& records) {
+        SetSection(section, reinterpret_cast<const char*>(records.data()), records.size() * sizeof(Record));
+    }
+
+    void SetSection(flat_base::Section section, const char* data, size_t size) {
+        sections_[static_cast<uint32_t>(section)].assign(data, size);
+    }
+
+    void Write(std::ostream& output) const {
+        flat_base::Header header{};
+        std::memcpy(header.magic, flat_base::MAGIC, sizeof(header.magic));
+        header.version = flat_base::VERSION;
+        header.section_count = SECTION_COUNT;
+        flat_base::SectionEntry table[SECTION_COUNT];
+        uint64_t offset = flat_base::SECTIONS_OFFSET;
+        for (uint32_t i = 0; i < SECTION_COUNT; ++i) {
+            table[i] = {offset, sections_[i].size()};
+            offset = AlignUp(offset + sections_[i].size());
+        }
+        output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        output.write(reinterpret_cast<const char*>(table), sizeof(table));
+        static constexpr char padding[flat_base::ALIGNMENT] = {};
+        for (uint32_t i = 0; i < SECTION_COUNT; ++i) {
+            const uint64_t size = sections_[i].size();
+            output.write(sections_[i].data(), size);
+            output.write(padding, AlignUp(size) - size);
+        }
+    }
+
+private:
+    static constexpr uint32_t SECTION_COUNT = static_cast<uint32_t>(flat_base::Section::COUNT);
+
+    static uint64_t AlignUp(uint64_t value) {
+        return (value + flat_base::ALIGNMENT - 1) / flat_base::ALIGNMENT * flat_base::ALIGNMENT;
+    }
+
+    std::string sections_[SECTION_COUNT];
+};
+
+// Checked access to the sections of a mapped flat base
+class FlatBaseReader {
+public:
+    FlatBaseReader(const char* data, size_t size) : data_(data) {
+        flat_base::Header header;
+        std::memcpy(&header, data, sizeof(header));
+        if (header.version != flat_base::VERSION || header.section_count != SECTION_COUNT
+            || size < flat_base::SECTIONS_OFFSET) {
+            throw std::runtime_error("Unsupported flat base");
+        }
+        std::memcpy(table_, data + sizeof(header), sizeof(table_));
+        for (const auto& entry : table_) {
+            if (entry.offset % flat_base::ALIGNMENT != 0 || entry.offset > size || entry.size > size - entry.offset) {
+                throw std::runtime_error("Broken flat base");
+            }
+        }
+    }
+
+    // records are aligned in the file and the mapping starts at a page boundary
+    template <typename Record>
+    std::pair<const Record*, size_t> GetRecords(flat_base::Section section) const {
+        const auto& entry = table_[static_cast<uint32_t>(section)];
+        if (entry.size % sizeof(Record) != 0) {
+            throw std::runtime_error("Broken flat base");
+        }
+        return {reinterpret_cast<const Record*>(data_ + entry.offset), entry.size / sizeof(Record)};
+    }
+
+    std::string_view GetBytes(flat_base::Section section) const {
+        const auto& entry = table_[static_cast<uint32_t>(section)];
+        return {data_ + entry.offset, entry.size};
+    }
+
+private:
+    static constexpr uint32_t SECTION_COUNT = static_cast<uint32_t>(flat_base::Section::COUNT);
+
+    const char* data_;
+    flat_base::SectionEntry table_[SECTION_COUNT];
+};
+
+uint32_t AddName(std::string& names, const std::string& name) {
+    const uint32_t offset = static_cast<uint32_t>(names.size());
+    names += name;
+    return offset;
+}
+
+std::string_view GetName(std::string_view names, uint32_t offset, uint32_t size) {
+    if (offset > names.size() || size > names.size() - offset) {
+        throw std::runtime_error("Broken flat base");
+    }
+    return names.substr(offset, size);
+}
+
+}
+
+void Serializer::SerializeFlatBase(std::ostream& output, const renderer::render_settings& render_settings,
+                                   std::future<std::string>& rendered_map) const {
+    const StopIds stop_ids = GetStopIds(db_);
+    std::string names;
+    std::vector<flat_base::Stop> stops;
+    stops.reserve(db_.GetStops().size());
+    for (const Stop& stop : db_.GetStops()) {
+        const uint32_t name_offset = AddName(names, stop.name);
+        stops.push_back({stop.coordinates.lat, stop.coordinates.lng, name_offset, static_cast<uint32_t>(stop.name.size())});
+    }
+    std::vector<flat_base::Bus> buses;
+    std::vector<uint32_t> bus_stops;
+    for (const auto& [name, bus_ptr] : db_.GetAllBuses()) {
+        flat_base::Bus bus{};
+        bus.name_offset = AddName(names, bus_ptr->name);
+        bus.name_size = static_cast<uint32_t>(bus_ptr->name.size());
+        bus.stops_offset = static_cast<uint32_t>(bus_stops.size());
+        bus.stops_count = static_cast<uint32_t>(bus_ptr->stops.size());
+        bus.is_roundtrip = bus_ptr->is_roundtrip;
+        for (const Stop* stop_ptr : bus_ptr->stops) {
+            bus_stops.push_back(stop_ids.at(stop_ptr));
+        }
+        buses.push_back(bus);
+    }
+    std::vector<flat_base::Distance> distances;
+    for (const auto& [src, dst, distance] : GetSortedDistances(db_, stop_ids)) {
+        distances.push_back({src, dst, distance});
+    }
+    transport_catalogue_serialize::TransportCatalogue settings;
+    *settings.mutable_render_settings() = CreateSerializeRenderSettings(render_settings);
+    *settings.mutable_router_settings() = CreateSerializeRouterSettings(router_.GetSettings());
+    settings.set_parent_checksum(parent_checksum_);
+    settings.set_rendered_map(TakeRenderedMap(rendered_map));
+    const std::string serialized_settings = settings.SerializeAsString();
+
+    FlatBaseWriter writer;
+    writer.SetSection(flat_base::Section::NAMES, names.data(), names.size());
+    writer.SetSection(flat_base::Section::STOPS, stops);
+    writer.SetSection(flat_base::Section::BUSES, buses);
+    writer.SetSection(flat_base::Section::BUS_STOPS, bus_stops);
+    writer.SetSection(flat_base::Section::DISTANCES, distances);
+    writer.SetSection(flat_base::Section::SETTINGS, serialized_settings.data(), serialized_settings.size());
+    writer.Write(output);
+}
+
+FlatBaseReader GetFlatBaseReader(const std::unique_ptr<flat_base::MappedFile>& base) {
+    if (!base) {
+        throw std::logic_error("Base is not open");
+    }
+    return FlatBaseReader(base->Data(), base->Size());
+}
+
+void Serializer::DeserializeFlatStopsAndBuses() {
+    const FlatBaseReader reader = GetFlatBaseReader(base_);
+    const std::string_view names = reader.GetBytes(flat_base::Section::NAMES);
+
+    const auto [flat_stops, stops_count] = reader.GetRecords<flat_base::Stop>(flat_base::Section::STOPS);
+    stops_.clear();
+    stops_.reserve(stops_count);
+    for (size_t i = 0; i < stops_count; ++i) {
+        const auto& stop = flat_stops[i];
+        db_.AddStop({std::string(GetName(names, stop.name_offset, stop.name_size)), {stop.lat, stop.lng}});
+        stops_.push_back(&db_.GetStops().back());
+    }
+
+    const auto [bus_stops, bus_stops_count] = reader.GetRecords<uint32_t>(flat_base::Section::BUS_STOPS);
+    const auto [flat_buses, buses_count] = reader.GetRecords<flat_base::Bus>(flat_base::Section::BUSES);
+    for (size_t i = 0; i < buses_count; ++i) {
+        const auto& bus = flat_buses[i];
+        if (bus.stops_offset > bus_stops_count || bus.stops_count > bus_stops_count - bus.stops_offset) {
+            throw std::runtime_error("Broken flat base");
+        }
+        Bus bus_result;
+        bus_result.name = GetName(names, bus.name_offset, bus.name_size);
+        bus_result.is_roundtrip = bus.is_roundtrip != 0;
+        bus_result.stops.reserve(bus.stops_count);
+        for (uint32_t j = 0; j < bus.stops_count; ++j) {
+            bus_result.stops.push_back(stops_.at(bus_stops[bus.stops_offset + j]));
+        }
+        db_.AddBus(std::move(bus_result));
+    }
+}
+
+void Serializer::DeserializeFlatDistances() {
+    const FlatBaseReader reader = GetFlatBaseReader(base_);
+    const auto [distances, distances_count] = reader.GetRecords<flat_base::Distance>(flat_base::Section::DISTANCES);
+    for (size_t i = 0; i < distances_count; ++i) {
+        db_.SetDistanceBetweenStops(stops_.at(distances[i].src), stops_.at(distances[i].dst), distances[i].distance);
+    }
+}
+
+void Serializer::DeserializeFlatSettings() {
+    const FlatBaseReader reader = GetFlatBaseReader(base_);
+    const std::string_view serialized_settings = reader.GetBytes(flat_base::Section::SETTINGS);
+    transport_catalogue_serialize::TransportCatalogue settings;
+    if (!settings.ParseFromArray(serialized_settings.data(), static_cast<int>(serialized_settings.size()))) {
+        throw std::runtime_error("Broken flat base");
+    }
+    renderer_.SetSettings(CreateRenderSettings(settings.render_settings()));
+    router_.SetSettings(CreateRouterSettings(settings.router_settings()));
+    parent_checksum_ = settings.parent_checksum();
+    if (!settings.rendered_map().empty()) {
+        renderer_.SetRenderedMap(std::move(*settings.mutable_rendered_map()), db_.GetStopsAndBusesVersion());
+    }
 }
 
 }
@@ -1,24 +1,87 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <optional>
+#include <ostream>
 #include <string>
+#include <vector>
 
+#include "flat_base.h"
 #include "map_renderer.h"
 #include "transport_router.h"
 #include "transport_catalogue.h"
 
+namespace transport_catalogue_serialize {
+class TransportCatalogue;
+}
+
 namespace transport_catalogue {
 
 class Serializer {
 public:
     Serializer(TransportCatalogue& db, renderer::MapRenderer& renderer, TransportRouter& router) : db_(db), renderer_(renderer), router_(router) {
     }
+    // format of the base written by SerializeBaseToFile, reading detects it by itself
+    enum class Format {
+        PROTOBUF,
+        COMPACT,
+        STREAM,
+        FLAT
+    };
+
     void SerializeBaseToFile();
+    // loads the whole base
     void DeserializeBaseFromFile();
-    void SetSettings(std::string file_name);
+    // Loads stops and buses. A flat base stays mapped and its distances and settings
+    // are read by the calls below when needed, other formats are loaded at once
+    void OpenBase();
+    void LoadDistances();
+    void LoadSettings();
+    void SetSettings(std::string file_name, Format format = Format::PROTOBUF);
+
+    // Base a delta is applied to. Its CRC-32 is checked against expected_checksum when
+    // it's given and is kept in the new base, so every base points to its parent
+    void SetParentBase(std::string file_name, std::optional<uint32_t> expected_checksum);
+    // loads the whole parent base if there is one
+    void LoadParentBase();
+    // CRC-32 of the parent of the loaded base, 0 for a base made from scratch
+    uint32_t GetParentChecksum() const {
+        return parent_checksum_;
+    }
 private:
+    void DeserializeOpenBase();
+    // the map rendered in parallel with serialization, empty if it isn't rendered
+    std::future<std::string> RenderMapAsync() const;
+    void SerializeProtobufBase(std::ostream& output, const renderer::render_settings& render_settings,
+                               std::future<std::string>& rendered_map) const;
+    void SerializeFlatBase(std::ostream& output, const renderer::render_settings& render_settings,
+                           std::future<std::string>& rendered_map) const;
+    void SerializeStreamBase(std::ostream& output, const renderer::render_settings& render_settings,
+                             std::future<std::string>& rendered_map) const;
+    void DeserializeProtobufBase(const char* data, size_t size);
+    void DeserializeStreamBase(const char* data, size_t size);
+    void ExtractCatalogue(transport_catalogue_serialize::TransportCatalogue& serialized_catalogue, std::vector<const Stop*>& stops);
+    void DeserializeFlatStopsAndBuses();
+    void DeserializeFlatDistances();
+    void DeserializeFlatSettings();
+
     TransportCatalogue& db_;
     renderer::MapRenderer& renderer_;
     TransportRouter& router_;
     std::string file_name_;
+    Format format_ = Format::PROTOBUF;
+
+    std::unique_ptr<flat_base::MappedFile> base_;
+    // stop pointers by stop id in the open base
+    std::vector<const Stop*> stops_;
+    bool distances_loaded_ = false;
+    bool settings_loaded_ = false;
+
+    std::string parent_file_name_;
+    std::optional<uint32_t> expected_parent_checksum_;
+    uint32_t parent_checksum_ = 0;
 };
 }
@@ -1,5 +1,7 @@
 #include "svg.h"
 
+#include <cmath>
+
 namespace svg {
 
 using namespace std::literals;
@@ -34,7 +36,7 @@ void ColorPrinter::operator()(std::monostate) const {
     out << "none"s;
 }
 
-void ColorPrinter::operator()(std::string color) const {
+void ColorPrinter::operator()(const std::string& color) const {
     out << color;
 }
 
@@ -51,11 +53,113 @@ void ColorPrinter::operator()(Rgba color) const {
     << color.opacity << ")"s;
 }
 
-std::ostream& operator<<(std::ostream& out, const Color color) {
+std::ostream& operator<<(std::ostream& out, const Color& color) {
     std::visit(ColorPrinter{out}, color);
     return out;
 }
 
+namespace detail {
+
+void RenderDocumentStart(std::ostream& out, const DocumentAttrs& attrs) {
+    out << "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"sv;
+    out << "<svg xmlns=\"http://www.w3.org/2000/svg\""sv;
+    if (attrs.xlink) {
+        out << " xmlns:xlink=\"http://www.w3.org/1999/xlink\""sv;
+    }
+    out << " version=\"1.1\""sv;
+    if (attrs.size) {
+        const Size& size = *attrs.size;
+        out << " width=\""sv << size.width << "\" height=\""sv << size.height
+            << "\" viewBox=\"0 0 "sv << size.width << " "sv << size.height << "\""sv;
+    }
+    out << ">\n"sv;
+}
+
+void RenderDocumentEnd(std::ostream& out) {
+    out << "</svg>"sv;
+}
+
+void RenderPathAttrs(std::ostream& out, const PathAttrs& attrs) {
+    if (attrs.class_name) {
+        out << " class=\""sv << *attrs.class_name << "\""sv;
+    }
+    if (attrs.fill_color) {
+        out << " fill=\""sv << *attrs.fill_color << "\""sv;
+    }
+    if (attrs.stroke_color) {
+        out << " stroke=\""sv << *attrs.stroke_color << "\""sv;
+    }
+    if (attrs.stroke_width) {
+        out << " stroke-width=\""sv << *attrs.stroke_width << "\""sv;
+    }
+    if (attrs.stroke_linecap) {
+        out << " stroke-linecap=\""sv << *attrs.stroke_linecap << "\""sv;
+    }
+    if (attrs.stroke_linejoin) {
+        out << " stroke-linejoin=\""sv << *attrs.stroke_linejoin << "\""sv;
+    }
+}
+
+void RenderCircle(std::ostream& out, Point center, double radius, const PathAttrs& attrs) {
+    out << "<circle cx=\""sv << center.x << "\" cy=\""sv << center.y << "\" "sv;
+    out << "r=\""sv << radius << "\" "sv;
+    RenderPathAttrs(out, attrs);
+    out << "/>"sv;
+}
+
+void RenderPolylineStart(std::ostream& out) {
+    out << "<polyline points=\""sv;
+}
+
+void RenderPolylinePoint(std::ostream& out, Point point, bool is_first) {
+    if (!is_first) {
+        out.put(' ');
+    }
+    out << point.x << ","sv << point.y;
+}
+
+void RenderPolylineEnd(std::ostream& out, const PathAttrs& attrs) {
+    out << "\""sv;
+    RenderPathAttrs(out, attrs);
+    out << " />"sv;
+}
+
+// <text x="20" y="35" class="small">My</text>
+void RenderText(std::ostream& out, const TextAttrs& text, std::string_view data, const PathAttrs& attrs) {
+    out << "<text "sv;
+    out << "x=\""sv << text.position.x << "\" y=\""sv << text.position.y << "\""sv;
+    if (text.offset)
+        out << " dx=\""sv << text.offset->x << "\" dy=\""sv << text.offset->y << "\""sv;
+    if (text.font_size)
+        out << " font-size=\""sv << *text.font_size << "\""sv;
+    if (text.font_family)
+        out << " font-family=\""sv << *text.font_family << "\""sv;
+    if (text.font_weight)
+        out << " font-weight=\""sv << *text.font_weight << "\""sv;
+    else if (text.font_size)
+        out.put(' ');
+    RenderPathAttrs(out, attrs);
+    out << ">"sv;
+    for (const auto& letter : data) {
+        if (letter == '"') {
+            out << "&quot;"sv;
+        } else if (letter == '<') {
+            out << "&lt;"sv;
+        } else if (letter == '>') {
+            out << "&gt;"sv;
+        } else if (letter == '\'') {
+            out << "&apos;"sv;
+        } else if (letter == '&') {
+            out << "&amp;"sv;
+        } else {
+            out << letter;
+        }
+    }
+    out << "</text>"sv;
+}
+
+}
+
 void Object::Render(const RenderContext& context) const {
     context.RenderIndent();
 
@@ -78,11 +182,7 @@ Circle& Circle::SetRadius(double radius)  {
 }
 
 void Circle::RenderObject(const RenderContext& context) const {
-    auto& out = context.out;
-    out << "<circle cx=\""s << center_.x << "\" cy=\""s << center_.y << "\" "s;
-    out << "r=\""s << radius_ << "\" "s;
-    RenderAttrs(context.out);
-    out << "/>"s;
+    detail::RenderCircle(context.out, center_, radius_, GetPathAttrs());
 }
 
 Polyline& Polyline::AddPoint(Point point) {
@@ -91,19 +191,11 @@ Polyline& Polyline::AddPoint(Point point) {
 }
 
 void Polyline::RenderObject(const RenderContext& context) const {
-    auto& out = context.out;
-    out << "<polyline points=\""s;
-    int num_points  = static_cast<int>(points_.size());
-    for (int i = 0; i < num_points; ++i) {
-        if (i != num_points - 1) {
-            out << points_[i].x << ","s << points_[i].y << " "s;
-        } else {
-            out << points_[i].x << ","s << points_[i].y;
-        }
+    detail::RenderPolylineStart(context.out);
+    for (size_t i = 0; i < points_.size(); ++i) {
+        detail::RenderPolylinePoint(context.out, points_[i], i == 0);
     }
-    out << "\""s;
-    RenderAttrs(context.out);
-    out << " />"s;
+    detail::RenderPolylineEnd(context.out, GetPathAttrs());
 }
 
 Text& Text::SetPosition(Point pos) {
@@ -141,36 +233,15 @@ Text& Text::SetData(std::string data) {
     return *this;
 }
 
-// <text x="20" y="35" class="small">My</text>
 void Text::RenderObject(const RenderContext& context) const {
-    auto& out = context.out;
-    out << "<text "s;
-    out << "x=\""s << position_.x << "\" y=\""s << position_.y << "\" "s;
-    out << "dx=\""s << offset_.x << "\" dy=\""s << offset_.y << "\" "s;
-    out << "font-size=\""s << font_size_ << "\" "s;
-    if (font_family_)
-        out << "font-family=\""s << *font_family_ << "\" "s;
-    if (font_weight_)
-        out << "font-weight=\""s << *font_weight_ << "\""s;
-    RenderAttrs(context.out);
-    out << ">"sv;
-    for (const auto& letter : data_) {
-        if (letter == '"') {
-            out << "&quot;"s;
-        } else if (letter == '<') {
-            out << "&lt;"s;
-        } else if (letter == '>') {
-            out << "&gt;"s;
-        } else if (letter == '\'') {
-            out << "&apos;"s;
-        } else if (letter == '&') {
-            out << "&amp;"s;
-        } else {
-            out << letter;
-        }
+    TextAttrs text{position_, offset_, font_size_, std::nullopt, std::nullopt};
+    if (font_family_) {
+        text.font_family = *font_family_;
+    }
+    if (font_weight_) {
+        text.font_weight = *font_weight_;
     }
-    out << "</text>"s;
-    
+    detail::RenderText(context.out, text, data_, GetPathAttrs());
 }
 
 // Добавляет в svg-документ объект-наследник svg::Object
@@ -180,12 +251,167 @@ void Document::AddPtr(std::unique_ptr<Object>&& obj) {
 
 // Выводит в ostream svg-представление документа
 void Document::Render(std::ostream& out) const {
-    out << "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>"s << std::endl;
-    out << "<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\">"s << std::endl;
+    detail::RenderDocumentStart(out);
     for (const auto& object : objects_ptr_) {
         object->Render(RenderContext(out));
     }
-    out << "</svg>"s;
+    detail::RenderDocumentEnd(out);
+}
+
+// ---------- Writer ------------------
+
+Writer::Writer(std::ostream& out, Mode mode)
+    : out_(out), mode_(mode) {
+    if (mode_ == Mode::DOCUMENT) {
+        detail::RenderDocumentStart(out_);
+    }
+}
+
+Writer::Writer(std::ostream& out, const DocumentAttrs& attrs, std::optional<int> decimals)
+    : out_(out), mode_(Mode::DOCUMENT) {
+    if (decimals) {
+        SetPrecision(*decimals);
+    }
+    PrecisionGuard guard(out_, scale_.has_value());
+    DocumentAttrs rounded_attrs = attrs;
+    if (rounded_attrs.size) {
+        rounded_attrs.size = Size{Round(attrs.size->width), Round(attrs.size->height)};
+    }
+    detail::RenderDocumentStart(out_, rounded_attrs);
+}
+
+void Writer::AddCircle(Point center, double radius, const PathAttrs& attrs) {
+    PrecisionGuard guard(out_, scale_.has_value());
+    detail::RenderCircle(out_, Round(center), Round(radius), Round(attrs));
+    out_.put('\n');
+}
+
+void Writer::StartPolyline() {
+    detail::RenderPolylineStart(out_);
+    is_first_point_ = true;
+}
+
+void Writer::AddPolylinePoint(Point point) {
+    PrecisionGuard guard(out_, scale_.has_value());
+    detail::RenderPolylinePoint(out_, Round(point), is_first_point_);
+    is_first_point_ = false;
+}
+
+void Writer::EndPolyline(const PathAttrs& attrs) {
+    PrecisionGuard guard(out_, scale_.has_value());
+    detail::RenderPolylineEnd(out_, Round(attrs));
+    out_.put('\n');
+}
+
+void Writer::AddText(const TextAttrs& text, std::string_view data, const PathAttrs& attrs) {
+    PrecisionGuard guard(out_, scale_.has_value());
+    TextAttrs rounded_text = text;
+    rounded_text.position = Round(text.position);
+    if (rounded_text.offset) {
+        rounded_text.offset = Round(*text.offset);
+    }
+    detail::RenderText(out_, rounded_text, data, Round(attrs));
+    out_.put('\n');
+}
+
+void Writer::StartGroup(const GroupAttrs& attrs) {
+    PrecisionGuard guard(out_, scale_.has_value());
+    out_ << "<g"sv;
+    if (attrs.clip_path) {
+        out_ << " clip-path=\"url(#"sv << *attrs.clip_path << ")\""sv;
+    }
+    if (attrs.translation) {
+        const Point translation = Round(*attrs.translation);
+        out_ << " transform=\"translate("sv << translation.x << ","sv << translation.y << ")\""sv;
+    }
+    if (attrs.font_size) {
+        out_ << " font-size=\""sv << *attrs.font_size << "\""sv;
+    }
+    if (attrs.font_family) {
+        out_ << " font-family=\""sv << *attrs.font_family << "\""sv;
+    }
+    if (attrs.font_weight) {
+        out_ << " font-weight=\""sv << *attrs.font_weight << "\""sv;
+    }
+    detail::RenderPathAttrs(out_, Round(attrs.path));
+    out_ << ">\n"sv;
+}
+
+void Writer::EndGroup() {
+    out_ << "</g>\n"sv;
+}
+
+void Writer::AddStyle(std::string_view css) {
+    out_ << "<style>"sv << css << "</style>\n"sv;
+}
+
+void Writer::StartDefs() {
+    out_ << "<defs>\n"sv;
+}
+
+void Writer::EndDefs() {
+    out_ << "</defs>\n"sv;
+}
+
+void Writer::DefineCircle(std::string_view id, double radius, const PathAttrs& attrs) {
+    PrecisionGuard guard(out_, scale_.has_value());
+    out_ << "<circle id=\""sv << id << "\" r=\""sv << Round(radius) << "\""sv;
+    detail::RenderPathAttrs(out_, Round(attrs));
+    out_ << "/>\n"sv;
+}
+
+void Writer::DefineClipRect(std::string_view id, Size size) {
+    PrecisionGuard guard(out_, scale_.has_value());
+    out_ << "<clipPath id=\""sv << id << "\"><rect width=\""sv << Round(size.width)
+         << "\" height=\""sv << Round(size.height) << "\"/></clipPath>\n"sv;
+}
+
+void Writer::AddUse(std::string_view id, Point position) {
+    PrecisionGuard guard(out_, scale_.has_value());
+    position = Round(position);
+    out_ << "<use xlink:href=\"#"sv << id << "\" x=\""sv << position.x << "\" y=\""sv << position.y << "\"/>\n"sv;
+}
+
+void Writer::SetPrecision(int decimals) {
+    scale_ = std::pow(10.0, decimals);
+}
+
+// 15 значащих цифр выводят ближайшее к округлённому числу double без хвоста из девяток
+Writer::PrecisionGuard::PrecisionGuard(std::ostream& out, bool is_rounded)
+    : out_(out), precision_(out.precision()) {
+    if (is_rounded) {
+        out_.precision(15);
+    }
+}
+
+Writer::PrecisionGuard::~PrecisionGuard() {
+    out_.precision(precision_);
+}
+
+double Writer::Round(double value) const {
+    if (!scale_) {
+        return value;
+    }
+    // + 0.0 превращает -0 в 0
+    return std::round(value * *scale_) / *scale_ + 0.0;
+}
+
+Point Writer::Round(Point point) const {
+    return {Round(point.x), Round(point.y)};
+}
+
+PathAttrs Writer::Round(const PathAttrs& attrs) const {
+    PathAttrs result = attrs;
+    if (result.stroke_width) {
+        result.stroke_width = Round(*result.stroke_width);
+    }
+    return result;
+}
+
+void Writer::Finish() {
+    if (mode_ == Mode::DOCUMENT) {
+        detail::RenderDocumentEnd(out_);
+    }
 }
 
 }  // namespace svg
@@ -6,6 +6,7 @@
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <vector>
 #include <variant>
@@ -44,7 +45,7 @@ struct ColorPrinter {
     std::ostream& out;
     
     void operator()(std::monostate) const;
-    void operator()(std::string color) const;
+    void operator()(const std::string& color) const;
     void operator()(Rgb color) const;
     void operator()(Rgba color) const;
     
@@ -68,7 +69,20 @@ enum class StrokeLineJoin {
 
 std::ostream& operator<<(std::ostream& out, StrokeLineJoin linejoin);
 
-std::ostream& operator<<(std::ostream& out, const Color color);
+std::ostream& operator<<(std::ostream& out, const Color& color);
+
+/*
+ * Атрибуты заливки и обводки, значения не копируются.
+ * Отсутствующий атрибут не выводится
+ */
+struct PathAttrs {
+    std::optional<std::string_view> class_name;
+    const Color* fill_color = nullptr;
+    const Color* stroke_color = nullptr;
+    std::optional<double> stroke_width;
+    std::optional<StrokeLineCap> stroke_linecap;
+    std::optional<StrokeLineJoin> stroke_linejoin;
+};
 
 template <typename Owner>
 class PathProps {
@@ -96,23 +110,11 @@ public:
 protected:
     ~PathProps() = default;
 
-    void RenderAttrs(std::ostream& out) const {
-        using namespace std::literals;
-        if (fill_color_) {
-            out << " fill=\""s << *fill_color_ << "\""s;
-        }
-        if (stroke_color_) {
-            out << " stroke=\""s << *stroke_color_ << "\""s;
-        }
-        if (width_) {
-            out << " stroke-width=\""s << *width_ << "\""s;
-        }
-        if (linecap_) {
-            out << " stroke-linecap=\""s << *linecap_ << "\""s;
-        }
-        if (linejoin_) {
-            out << " stroke-linejoin=\""s << *linejoin_ << "\""s;
-        }
+    PathAttrs GetPathAttrs() const {
+        return {std::nullopt,
+                fill_color_ ? &*fill_color_ : nullptr,
+                stroke_color_ ? &*stroke_color_ : nullptr,
+                width_, linecap_, linejoin_};
     }
 
 private:
@@ -141,6 +143,64 @@ struct Point {
     double y = 0;
 };
 
+/*
+ * Атрибуты тега <text>, строки не копируются.
+ * Смещение и размер шрифта можно не выводить, если их задаёт группа
+ */
+struct TextAttrs {
+    Point position;
+    std::optional<Point> offset;
+    std::optional<uint32_t> font_size;
+    std::optional<std::string_view> font_family;
+    std::optional<std::string_view> font_weight;
+};
+
+struct Size {
+    double width = 0;
+    double height = 0;
+};
+
+/*
+ * Атрибуты корневого тега <svg>.
+ * Размер выводится как width, height и viewBox="0 0 width height",
+ * xlink объявляет пространство имён xlink, нужное тегам <use> в SVG 1.1
+ */
+struct DocumentAttrs {
+    std::optional<Size> size;
+    bool xlink = false;
+};
+
+/*
+ * Атрибуты тега <g>, их наследуют все элементы группы.
+ * Сдвиг выводится как transform="translate(x,y)",
+ * clip_path - идентификатор области обрезки, clip-path="url(#id)"
+ */
+struct GroupAttrs {
+    std::optional<Point> translation;
+    std::optional<std::string_view> clip_path;
+    std::optional<uint32_t> font_size;
+    std::optional<std::string_view> font_family;
+    std::optional<std::string_view> font_weight;
+    PathAttrs path;
+};
+
+/*
+ * Вывод тегов, общий для объектов документа и Writer
+ */
+namespace detail {
+
+void RenderDocumentStart(std::ostream& out, const DocumentAttrs& attrs = {});
+void RenderDocumentEnd(std::ostream& out);
+void RenderPathAttrs(std::ostream& out, const PathAttrs& attrs);
+void RenderCircle(std::ostream& out, Point center, double radius, const PathAttrs& attrs);
+// Ломаная выводится по частям: начало тега, точки по одной, конец тега с атрибутами
+void RenderPolylineStart(std::ostream& out);
+void RenderPolylinePoint(std::ostream& out, Point point, bool is_first);
+void RenderPolylineEnd(std::ostream& out, const PathAttrs& attrs);
+void RenderText(std::ostream& out, const TextAttrs& text, std::string_view data, const PathAttrs& attrs);
+
+}
+
 /*
  * Вспомогательная структура, хранящая контекст для вывода SVG-документа с отступами.
  * Хранит ссылку на поток вывода, текущее значение и шаг отступа при выводе элемента
@@ -277,4 +337,76 @@ private:
     std::vector<std::unique_ptr<Object>> objects_ptr_;
 };
 
+/*
+ * Класс Writer выводит SVG-документ сразу в поток, не создавая объектов для тегов.
+ * Теги выводятся так же, как их выводит Document
+ */
+class Writer {
+public:
+    // Фрагмент содержит только теги элементов, без заголовка и закрывающего тега документа
+    enum class Mode {
+        DOCUMENT,
+        FRAGMENT
+    };
+
+    // Выводит заголовок документа
+    explicit Writer(std::ostream& out, Mode mode = Mode::DOCUMENT);
+    // Выводит заголовок документа с атрибутами attrs, размеры округляются до decimals знаков
+    Writer(std::ostream& out, const DocumentAttrs& attrs, std::optional<int> decimals = std::nullopt);
+
+    void AddCircle(Point center, double radius, const PathAttrs& attrs);
+
+    // Точки ломаной передаются по одной между StartPolyline и EndPolyline
+    void StartPolyline();
+    void AddPolylinePoint(Point point);
+    void EndPolyline(const PathAttrs& attrs);
+
+    void AddText(const TextAttrs& text, std::string_view data, const PathAttrs& attrs);
+
+    // Группа <g>, в ней элементы могут не повторять общие атрибуты
+    void StartGroup(const GroupAttrs& attrs);
+    void EndGroup();
+
+    // Таблица стилей <style>, текст не экранируется
+    void AddStyle(std::string_view css);
+
+    // Секция <defs> со стилями и фигурами, на которые ссылаются теги <use>
+    void StartDefs();
+    void EndDefs();
+    // Круг с центром в начале координат и идентификатором id
+    void DefineCircle(std::string_view id, double radius, const PathAttrs& attrs);
+    // Прямоугольная область обрезки id от начала координат размером size
+    void DefineClipRect(std::string_view id, Size size);
+    // Копия фигуры id, сдвинутая в точку position. Ссылка выводится как xlink:href,
+    // поэтому документ должен объявить пространство имён xlink
+    void AddUse(std::string_view id, Point position);
+
+    // Координаты и размеры округляются до decimals знаков после запятой,
+    // без этого числа выводятся с точностью потока
+    void SetPrecision(int decimals);
+
+    // Выводит закрывающий тег документа
+    void Finish();
+
+private:
+    // На время вывода тега ставит потоку точность, достаточную для округлённых чисел
+    class PrecisionGuard {
+    public:
+        PrecisionGuard(std::ostream& out, bool is_rounded);
+        ~PrecisionGuard();
+    private:
+        std::ostream& out_;
+        std::streamsize precision_;
+    };
+
+    double Round(double value) const;
+    Point Round(Point point) const;
+    PathAttrs Round(const PathAttrs& attrs) const;
+
+    std::ostream& out_;
+    Mode mode_;
+    std::optional<double> scale_;
+    bool is_first_point_ = true;
+};
+
 }  // namespace svg
@@ -1,5 +1,4 @@
 #include <algorithm>
-#include <execution>
 #include <iostream>
 #include <unordered_set>
 #include <vector>
@@ -11,8 +10,9 @@ namespace transport_catalogue {
 using namespace std;
 
 void TransportCatalogue::AddStop(Stop stop) {
-    stops_.push_back(stop);
+    stops_.push_back(std::move(stop));
     pointers_to_stops_[stops_.back().name] = &stops_.back();
+    ++stops_and_buses_version_;
 }
 
 void TransportCatalogue::SetDistanceBetweenStops(const Stop* src, const Stop* dst, int64_t distance) {
@@ -20,8 +20,30 @@ void TransportCatalogue::SetDistanceBetweenStops(const Stop* src, const Stop* ds
 }
 
 void TransportCatalogue::AddBus(Bus bus) {
-    buses_.push_back(bus);
+    buses_.push_back(std::move(bus));
     pointers_to_buses_[buses_.back().name] = &buses_.back();
+    ++stops_and_buses_version_;
+}
+
+// stops_ and buses_ own the objects, so casting away const of our own pointers is safe
+void TransportCatalogue::AddOrUpdateStop(Stop stop) {
+    if (const auto it = pointers_to_stops_.find(stop.name); it != pointers_to_stops_.end()) {
+        const_cast<Stop*>(it->second)->coordinates = stop.coordinates;
+        ++stops_and_buses_version_;
+    } else {
+        AddStop(std::move(stop));
+    }
+}
+
+void TransportCatalogue::AddOrUpdateBus(Bus bus) {
+    if (const auto it = pointers_to_buses_.find(bus.name); it != pointers_to_buses_.end()) {
+        Bus* known_bus = const_cast<Bus*>(it->second);
+        known_bus->stops = std::move(bus.stops);
+        known_bus->is_roundtrip = bus.is_roundtrip;
+        ++stops_and_buses_version_;
+    } else {
+        AddBus(std::move(bus));
+    }
 }
 
 std::optional<std::vector<std::string_view>> TransportCatalogue::GetBusesByStopName(string_view stop_name) const {
@@ -97,7 +119,11 @@ const std::unordered_map<std::string_view, const Stop*>& TransportCatalogue::Get
     return pointers_to_stops_;
 }
 
-const std::unordered_map<std::pair<const Stop*, const Stop*>, int64_t, detail::PairHasher<const Stop*>> TransportCatalogue::GetStopDistances() const {
+const std::deque<Stop>& TransportCatalogue::GetStops() const {
+    return stops_;
+}
+
+const std::unordered_map<std::pair<const Stop*, const Stop*>, int64_t, detail::PairHasher<const Stop*>>& TransportCatalogue::GetStopDistances() const {
     return stops_distance_;
 }
 
@@ -109,4 +135,8 @@ size_t TransportCatalogue::GetNumberOfBuses() const {
     return buses_.size();
 }
 
+uint64_t TransportCatalogue::GetStopsAndBusesVersion() const {
+    return stops_and_buses_version_;
+}
+
 }
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <cstdint>
 #include <deque>
 #include <map>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <set>
@@ -31,6 +33,10 @@ public:
     void AddStop(Stop stop);
     void SetDistanceBetweenStops(const Stop* src, const Stop* dst, int64_t distance);
     void AddBus(Bus bus);
+    // Change the stop or the bus with the same name in place or add a new one,
+    // pointers to a changed stop or bus stay valid
+    void AddOrUpdateStop(Stop stop);
+    void AddOrUpdateBus(Bus bus);
     const Stop* GetStopByName(std::string_view stop_name) const;
     const Bus* GetBusByName(std::string_view bus_name) const;
     std::optional<std::vector<std::string_view>> GetBusesByStopName(std::string_view stop_name) const;
@@ -38,11 +44,16 @@ public:
     BusInfo GetBusInfoByBus(const Bus* bus) const;
     const std::map<std::string_view, const Bus*>& GetAllBuses() const;
     const std::unordered_map<std::string_view, const Stop*>& GetAllStops() const;
-    const std::unordered_map<std::pair<const Stop*, const Stop*>, int64_t, detail::PairHasher<const Stop*>> GetStopDistances() const;
+    // stops in the order they were added
+    const std::deque<Stop>& GetStops() const;
+    const std::unordered_map<std::pair<const Stop*, const Stop*>, int64_t, detail::PairHasher<const Stop*>>& GetStopDistances() const;
     size_t GetNumberOfStops() const;
     size_t GetNumberOfBuses() const;
+    // changes with every change of stops or buses, distances don't change it
+    uint64_t GetStopsAndBusesVersion() const;
 private:
-    
+    uint64_t stops_and_buses_version_ = 0;
+
     std::deque<Bus> buses_;
     std::deque<Stop> stops_;
     std::map<std::string_view, const Bus*> pointers_to_buses_;
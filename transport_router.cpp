@@ -1,6 +1,7 @@
 
 #include "transport_router.h"
 
+#include <cstdlib>
 #include <memory>
 #include <numeric>
 
@@ -27,14 +28,17 @@ void TransportRouter::AddEdgeToItem(graph::VertexId start_vertex, graph::VertexI
     edge_to_item_[route_graph_->AddEdge({start_vertex, stop_vertex, item.time})] = item;
 }
 
-void TransportRouter::AddBusEdge(const Stop* start_stop, const Stop* finish_stop, std::string_view bus_name, int span, double distance) {
+void TransportRouter::AddBusEdge(const Bus* bus_ptr, int start_index, int finish_index, std::string_view bus_name, double distance) {
     Item item;
     item.type = ItemType::BUS;
     item.name = bus_name;
     item.time = distance /(bus_velocity_ *  1000 / 60);
-    item.span_count = span;
-    AddEdgeToItem(GetStartBusVertexByStop(start_stop),
-                  GetStartWaitVertexByStop(finish_stop),
+    item.span_count = std::abs(finish_index - start_index);
+    item.bus = bus_ptr;
+    item.stop_index = start_index;
+    item.is_backward = finish_index < start_index;
+    AddEdgeToItem(GetStartBusVertexByStop(bus_ptr->stops[start_index]),
+                  GetStartWaitVertexByStop(bus_ptr->stops[finish_index]),
                   item);
 }
 
@@ -44,10 +48,10 @@ void TransportRouter::AddRouteToGraph(const std::string_view bus_name, const Bus
         double backward_distance = 0;
         for (int j = i; j < bus_ptr->stops.size() - 1; ++j) {
             forward_distance += catalogue_.GetDistanceByStopPair(bus_ptr->stops[j], bus_ptr->stops[j + 1]);
-            AddBusEdge(bus_ptr->stops[i], bus_ptr->stops[j + 1], bus_name, j - i + 1, forward_distance);
+            AddBusEdge(bus_ptr, i, j + 1, bus_name, forward_distance);
             if (!bus_ptr->is_roundtrip){
                 backward_distance += catalogue_.GetDistanceByStopPair(bus_ptr->stops[j + 1], bus_ptr->stops[j]);
-                AddBusEdge(bus_ptr->stops[j + 1], bus_ptr->stops[i], bus_name, j - i + 1, backward_distance);
+                AddBusEdge(bus_ptr, j + 1, i, bus_name, backward_distance);
             }
         }
     }
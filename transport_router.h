@@ -24,6 +24,10 @@ public:
         std::string_view name;
         double time;
         int span_count;
+        // a BUS item rides span_count stops of the bus from stops[stop_index], backward on the way back of a linear route
+        const Bus* bus = nullptr;
+        int stop_index = 0;
+        bool is_backward = false;
     };
     
     struct RouteItems {
@@ -48,7 +52,7 @@ private:
     graph::VertexId GetStartWaitVertexByStop(const Stop* stop_ptr) const;
     graph::VertexId GetStartBusVertexByStop(const Stop* stop_ptr) const;
     void AddEdgeToItem(graph::VertexId start_vertex, graph::VertexId stop_vertex, Item item);
-    void AddBusEdge(const Stop* start_stop, const Stop* finish_stop, std::string_view bus_name, int span, double distance);
+    void AddBusEdge(const Bus* bus_ptr, int start_index, int finish_index, std::string_view bus_name, double distance);
     
     int bus_wait_time_;
     double bus_velocity_;